@@ -0,0 +1,209 @@
+#include "clock_sync.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <limits>
+
+namespace hnoker
+{
+    // What we allow the clocks to drift apart beyond the measured skew, per microsecond
+    static constexpr double residual_skew = 20e-6;
+    // Anything beyond this is a broken sample, not a real crystal
+    static constexpr double max_skew = 500e-6;
+
+    clock_sync::clock_sync(const clock_sync_options& options, leader_lookup leader) :
+        options(options),
+        leader(std::move(leader))
+    {}
+
+    clock_sync::~clock_sync()
+    {
+        net.stop();
+    }
+
+    void clock_sync::start()
+    {
+        io_thread = std::jthread{[this]() { net.run_until_stopped(); }};
+        thread = std::jthread{[this](std::stop_token st) { run(st); }};
+    }
+
+    std::int64_t clock_sync::local_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void clock_sync::answer(const TimeSync& request, std::int64_t received_us, std::span<char> write_buf)
+    {
+        Message msg{ MessageType::TIME_SYNC };
+        msg.ts.reply = true;
+        msg.ts.t0 = request.t0;
+        // Whatever decoding and handling took in between is ours, not the network's
+        msg.ts.t1 = received_us;
+        msg.ts.t2 = local_us();
+        write_message_to_buffer(write_buf, msg);
+    }
+
+    void clock_sync::run(std::stop_token st)
+    {
+        std::mutex sleep_mutex;
+        std::condition_variable_any sleeper;
+        while (!st.stop_requested())
+        {
+            const auto view = leader();
+            if (view->is_coordinator)
+            {
+                // We are the timebase
+                std::lock_guard<std::mutex> lock(mutex);
+                reference = view->my_id;
+                samples.clear();
+                have_estimate = true;
+                base_local = local_us();
+                base_offset = 0;
+                skew = 0.0;
+                base_error = 0;
+            }
+            else if (view->leader_id != 0 && !view->leader_ip.empty())
+            {
+                exchange(view->leader_id, view->leader_ip);
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeper.wait_for(lock, st, options.interval, []() { return false; });
+        }
+    }
+
+    void clock_sync::exchange(std::uint16_t leader_id, const std::string& ip)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (reference != leader_id)
+            {
+                // A new leader is a new timebase, nothing from the old one applies
+                INFO("Syncing clock to leader {}", leader_id);
+                reference = leader_id;
+                samples.clear();
+                have_estimate = false;
+            }
+        }
+
+        // Both only used on the io thread
+        auto t0 = std::make_shared<std::int64_t>(0);
+        const request_builder request = [t0]()
+        {
+            Message msg{ MessageType::TIME_SYNC };
+            msg.ts.reply = false;
+            msg.ts.t1 = 0;
+            msg.ts.t2 = 0;
+            msg.ts.t0 = *t0 = local_us();
+            return make_frame(msg);
+        };
+
+        net.async_request(ip, LISTENER_SERVER_PORT, request, reply_buf, options.deadline, [this, leader_id, t0](bool answered)
+        {
+            const std::int64_t t3 = local_us();
+            if (!answered)
+                return;
+            try
+            {
+                Message reply = read_message_from_buffer(reply_buf);
+                if (reply.type != MessageType::TIME_SYNC || !reply.ts.reply || reply.ts.t0 != *t0)
+                    return;
+                add_sample(leader_id, reply.ts, t3);
+            }
+            catch (const std::exception& e)
+            {
+                // Thrown here it would stop the io thread, a garbled answer is just a missed one
+                INFO("Couldn't read the time sync answer from {}: {}", leader_id, e.what());
+            }
+        });
+    }
+
+    void clock_sync::add_sample(std::uint16_t leader_id, const TimeSync& ts, std::int64_t t3)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (leader_id != reference)
+            return;
+
+        sample s;
+        s.local = t3;
+        s.offset = ((ts.t1 - ts.t0) + (ts.t2 - t3)) / 2;
+        s.delay = std::max<std::int64_t>(0, (t3 - ts.t0) - (ts.t2 - ts.t1));
+        samples.push_back(s);
+        while (samples.size() > options.window)
+            samples.pop_front();
+
+        estimate();
+        if (exchanges++ % 10 == 0)
+            INFO("Clock offset to leader {}: {:+.2f} ms, error {:.2f} ms, skew {:+.1f} ppm", reference, base_offset / 1000.0, base_error / 1000.0, skew * 1e6);
+    }
+
+    void clock_sync::estimate()
+    {
+        const auto best = std::min_element(samples.begin(), samples.end(), [](const sample& a, const sample& b) { return a.delay < b.delay; });
+
+        // Only the exchanges that weren't held up in a queue say anything about the trend
+        double n = 0, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+        for (const sample& s : samples)
+        {
+            if (s.delay > 2 * best->delay + 1000)
+                continue;
+            const double x = static_cast<double>(s.local - best->local);
+            const double y = static_cast<double>(s.offset - best->offset);
+            n++;
+            sum_x += x;
+            sum_y += y;
+            sum_xx += x * x;
+            sum_xy += x * y;
+        }
+
+        const double spread = n * sum_xx - sum_x * sum_x;
+        skew = 0.0;
+        if (n >= 4 && spread > 0.0)
+            skew = std::clamp((n * sum_xy - sum_x * sum_y) / spread, -max_skew, max_skew);
+
+        base_local = best->local;
+        base_offset = best->offset;
+        base_error = best->delay / 2;
+        have_estimate = true;
+    }
+
+    std::int64_t clock_sync::offset_at(std::int64_t local) const
+    {
+        return base_offset + static_cast<std::int64_t>(skew * static_cast<double>(local - base_local));
+    }
+
+    std::int64_t clock_sync::room_now_us() const
+    {
+        return to_room(local_us());
+    }
+
+    std::int64_t clock_sync::to_room(std::int64_t local) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return local + offset_at(local);
+    }
+
+    std::int64_t clock_sync::to_local(std::int64_t room) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // The skew barely moves the offset over a round trip, so one step is close enough
+        return room - offset_at(room - base_offset);
+    }
+
+    std::int64_t clock_sync::error_us() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!have_estimate)
+            return std::numeric_limits<std::int64_t>::max();
+        const double age = std::abs(static_cast<double>(local_us() - base_local));
+        return base_error + static_cast<std::int64_t>(age * residual_skew);
+    }
+
+    bool clock_sync::synced() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return have_estimate;
+    }
+}
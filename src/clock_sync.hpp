@@ -0,0 +1,94 @@
+#pragma once
+
+#include "election.hpp"
+#include "message_types.hpp"
+#include "networking.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
+
+namespace hnoker
+{
+    struct clock_sync_options
+    {
+        std::chrono::milliseconds interval{1000};
+        // Exchanges that take longer than this tell us little about the offset
+        std::chrono::milliseconds deadline{250};
+        // How many exchanges the estimate is made from
+        std::size_t window = 16;
+    };
+
+    // The leader's steady clock is the room's timebase. Every other listener
+    // keeps asking the leader what time it is, NTP style: the exchange with the
+    // shortest round trip in the window gives the offset, with half of its round
+    // trip as the error bound, and the trend of the offsets over the window
+    // gives the skew between the two clocks.
+    class clock_sync
+    {
+    public:
+        using leader_lookup = std::function<std::shared_ptr<const coordinator_view>()>;
+
+        clock_sync(const clock_sync_options& options, leader_lookup leader);
+        ~clock_sync();
+
+        clock_sync(const clock_sync&) = delete;
+        clock_sync& operator=(const clock_sync&) = delete;
+
+        void start();
+        // Leader side, fills write_buf with the answer to a request that was read at received_us
+        static void answer(const TimeSync& request, std::int64_t received_us, std::span<char> write_buf);
+
+        static std::int64_t local_us();
+        // Microseconds on the room's timebase
+        std::int64_t room_now_us() const;
+        std::int64_t to_room(std::int64_t local) const;
+        std::int64_t to_local(std::int64_t room) const;
+        // How far off room time can be, in microseconds
+        std::int64_t error_us() const;
+        bool synced() const;
+
+    private:
+        struct sample
+        {
+            std::int64_t local;
+            std::int64_t offset;
+            std::int64_t delay;
+        };
+
+        void run(std::stop_token st);
+        void exchange(std::uint16_t leader_id, const std::string& ip);
+        void add_sample(std::uint16_t leader_id, const TimeSync& ts, std::int64_t t3);
+        // These expect mutex to be held
+        void estimate();
+        std::int64_t offset_at(std::int64_t local) const;
+
+        clock_sync_options options;
+        leader_lookup leader;
+
+        mutable std::mutex mutex;
+        std::uint16_t reference = 0;
+        std::deque<sample> samples;
+        bool have_estimate = false;
+        std::int64_t base_local = 0;
+        std::int64_t base_offset = 0;
+        double skew = 0.0;
+        std::int64_t base_error = 0;
+        std::size_t exchanges = 0;
+
+        // Only touched on the io thread
+        std::array<char, 1024> reply_buf;
+        network net;
+        std::jthread io_thread;
+        std::jthread thread;
+    };
+}
@@ -0,0 +1,170 @@
+#include "command_log.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+
+namespace hnoker
+{
+    command_log::command_log(const command_log_options& options) :
+        options(options)
+    {}
+
+    std::uint64_t command_log::last_index()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return base_index + entries.size();
+    }
+
+    std::uint32_t command_log::term()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current_term;
+    }
+
+    std::uint32_t command_log::term_at(std::uint64_t index) const
+    {
+        if (index <= base_index)
+            return base_term;
+        return entries[index - base_index - 1].term;
+    }
+
+    void command_log::trim()
+    {
+        while (entries.size() > options.keep)
+        {
+            base_index = entries.front().index;
+            base_term = entries.front().term;
+            entries.pop_front();
+        }
+    }
+
+    AppendEntries command_log::append(std::uint32_t term, LogEntry entry)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (term > current_term)
+            current_term = term;
+
+        AppendEntries ae{};
+        ae.term = current_term;
+        ae.prev_index = base_index + entries.size();
+        ae.prev_term = term_at(ae.prev_index);
+        ae.reset = false;
+
+        entry.term = current_term;
+        entry.index = ae.prev_index + 1;
+        // Never before the one ahead of it, so time order stays log order
+        if (!entries.empty() && entry.execute_at_us != 0)
+            entry.execute_at_us = std::max(entry.execute_at_us, entries.back().execute_at_us);
+        entries.push_back(entry);
+        ae.entries.push_back(entry);
+        trim();
+        return ae;
+    }
+
+    AppendEntries command_log::since(std::uint64_t from_index)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::uint64_t last = base_index + entries.size();
+
+        AppendEntries ae{};
+        ae.term = current_term;
+        ae.reset = from_index < base_index || from_index > last;
+        if (ae.reset)
+        {
+            ae.prev_index = last;
+            ae.prev_term = term_at(last);
+            return ae;
+        }
+
+        ae.prev_index = from_index;
+        ae.prev_term = term_at(from_index);
+        for (std::uint64_t i = from_index + 1; i <= last && ae.entries.size() < options.max_batch; i++)
+            ae.entries.push_back(entries[i - base_index - 1]);
+        return ae;
+    }
+
+    command_log::received command_log::receive(const AppendEntries& ae)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        received r{outcome::applied, {}};
+
+        if (ae.term < current_term)
+        {
+            r.result = outcome::stale;
+            return r;
+        }
+        const bool newer_leader = ae.term > current_term;
+        current_term = ae.term;
+
+        if (ae.reset)
+        {
+            INFO("Command log is too far behind, starting over from {}", ae.prev_index);
+            entries.clear();
+            base_index = ae.prev_index;
+            base_term = ae.prev_term;
+            r.result = outcome::reset;
+            return r;
+        }
+
+        std::uint64_t last = base_index + entries.size();
+        if (ae.prev_index > last)
+        {
+            r.result = outcome::gap;
+            return r;
+        }
+        if (ae.prev_index < base_index && newer_leader)
+        {
+            // What we trimmed can't be checked against a new leader's log, so we take its
+            // entries from here on and the state that goes with them comes in full
+            INFO("Command log was trimmed past where leader {} starts at {}, starting over", ae.term, ae.prev_index);
+            entries.clear();
+            base_index = ae.prev_index;
+            base_term = ae.prev_term;
+            for (const LogEntry& e : ae.entries)
+            {
+                entries.push_back(e);
+                r.to_apply.push_back(e);
+            }
+            trim();
+            r.result = outcome::reset;
+            return r;
+        }
+        if (ae.prev_index == base_index && base_term != ae.prev_term)
+        {
+            // Nothing left to walk back through, the state has to come in full
+            entries.clear();
+            base_term = ae.prev_term;
+            r.result = outcome::reset;
+            return r;
+        }
+        if (ae.prev_index > base_index && term_at(ae.prev_index) != ae.prev_term)
+        {
+            // Our tail came from a leader this one never heard, it goes. It was already applied,
+            // so only the full state undoes it
+            INFO("Command log disagrees with the leader at {}, dropping {} entries", ae.prev_index, last - ae.prev_index + 1);
+            entries.resize(ae.prev_index - 1 - base_index);
+            r.result = outcome::reset;
+            return r;
+        }
+
+        for (const LogEntry& e : ae.entries)
+        {
+            if (e.index <= base_index)
+                continue;
+            last = base_index + entries.size();
+            if (e.index <= last)
+            {
+                if (term_at(e.index) == e.term)
+                    continue;
+                INFO("Command log disagrees with the leader at {}, dropping {} entries", e.index, last - e.index + 1);
+                entries.resize(e.index - base_index - 1);
+                // Same as above, what we dropped was already applied
+                r.result = outcome::reset;
+            }
+            entries.push_back(e);
+            r.to_apply.push_back(e);
+        }
+        trim();
+        return r;
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "message_types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace hnoker
+{
+    struct command_log_options
+    {
+        // Followers further behind than this get the full state instead
+        std::size_t keep = 256;
+        // Entries per AppendEntries, more don't fit in a frame
+        std::size_t max_batch = 16;
+    };
+
+    // Raft-lite log of player commands. Only the lease holder appends, so there
+    // is no vote and nothing to wait for: an entry is committed as soon as the
+    // leader has it, and followers apply entries strictly in index order. A
+    // follower that sees a hole asks for what it missed, and one whose log
+    // disagrees with a newer leader's drops its own tail.
+    class command_log
+    {
+    public:
+        explicit command_log(const command_log_options& options = {});
+
+        // Leader side, gives the entry its index and returns the AppendEntries to send out
+        AppendEntries append(std::uint32_t term, LogEntry entry);
+        // What comes after from_index, or a reset when that is no longer kept
+        AppendEntries since(std::uint64_t from_index);
+
+        enum class outcome
+        {
+            applied,
+            // Entries are missing before these, ask from last_index
+            gap,
+            // Too far behind, or entries we already applied were dropped, the full state has to come from elsewhere
+            reset,
+            // From a leader older than one we already follow
+            stale,
+        };
+        struct received
+        {
+            outcome result;
+            // New entries in order, only these get applied
+            std::vector<LogEntry> to_apply;
+        };
+        received receive(const AppendEntries& ae);
+
+        std::uint64_t last_index();
+        std::uint32_t term();
+
+    private:
+        // These expect mutex to be held
+        std::uint32_t term_at(std::uint64_t index) const;
+        void trim();
+
+        command_log_options options;
+        std::mutex mutex;
+        std::deque<LogEntry> entries;
+        // The entry just before the first one kept
+        std::uint64_t base_index = 0;
+        std::uint32_t base_term = 0;
+        std::uint32_t current_term = 0;
+    };
+}
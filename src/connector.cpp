@@ -1,16 +1,31 @@
 #include "connector.hpp"
+#include "failure_detector.hpp"
+#include "fanout.hpp"
 #include "logging.hpp"
+#include "membership_log.hpp"
 #include "message_types.hpp"
 #include "networking.hpp"
+#include "playback_table.hpp"
+#include "rate_limit.hpp"
+#include "region.hpp"
+#include "replication.hpp"
+#include "subscriptions.hpp"
 
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <format>
 #include <functional>
+#include <mutex>
 #include <random>
 #include <span>
+#include <stop_token>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -31,8 +46,10 @@ public:
 
 struct ClientInfo {
     Client client;
-    std::jthread thread;
-    std::chrono::time_point<std::chrono::steady_clock> timeout = clocker.now();
+    hnoker::phi_accrual_detector detector;
+    // Recovered from disk, probed instead of evicted until this passes or they are heard from
+    std::chrono::steady_clock::time_point grace_until{};
+    bool recovered = false;
 
     bool operator==(const ClientInfo& other) const
     {
@@ -47,40 +64,25 @@ bool operator==(const ClientInfo& lhs, const Client& rhs)
 }
 
 std::vector<ClientInfo> clients;
-
-std::jthread create_knocker(const std::string ip, const std::uint16_t port)
+// Both are kept in step with the table under clients_mutex
+static hnoker::membership_log membership_on_disk;
+static hnoker::membership_stream subscriptions;
+// Latest playback report per member, has its own lock
+static hnoker::playback_table playback;
+
+// Caller holds clients_mutex
+static std::vector<Client> client_table()
 {
-    return std::jthread{[=]()
-        {
-            std::array<char, 1024> read_buffer;
-            std::array<char, 1024> write_buffer;
-
-            std::span<char> read_span{read_buffer};
-            std::span<char> write_span{write_buffer};
-
-            Message qs_out{ MessageType::QUERY_STATUS };
-
-            INFO("Knocker created for {}:{}", ip, LISTENER_SERVER_PORT);
-            hnoker::read_write_op_t knocker_callback = [&qs_out](std::span<char> xd1, std::span<char> xd2, const std::string& ip, std::uint16_t port) -> bool
-            {
-                hnoker::write_message_to_buffer(xd2, qs_out);
-                return true;
-            };
-
-            hnoker::network knocker_network;
-
-            const hnoker::timeout_handler th = []() {
-            };
+    std::vector<Client> table;
+    for (const ClientInfo& c : clients)
+        table.push_back(c.client);
+    return table;
+}
 
-            while (true)
-            {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-                INFO("Knocking {}:{}", ip, LISTENER_SERVER_PORT);
-                knocker_network.async_connect_server(ip, LISTENER_SERVER_PORT, read_span, write_span, knocker_callback, hnoker::default_timeout_handler);
-                knocker_network.run();
-            }
-        }
-    };
+static void compact_log_if_needed()
+{
+    if (membership_on_disk.wants_compaction())
+        membership_on_disk.compact(client_table());
 }
 
 void remove_client(Client to_remove)
@@ -90,115 +92,462 @@ void remove_client(Client to_remove)
     {
         return client == to_remove;
     };
-    std::erase_if(clients, client_equals);
+    if (std::erase_if(clients, client_equals) > 0)
+    {
+        membership_on_disk.removed(to_remove);
+        subscriptions.left(to_remove);
+        playback.remove(to_remove.ip);
+        compact_log_if_needed();
+    }
 }
 
 void refresh_timeout(Client to_refresh)
 {
+    auto now = clocker.now();
     for (ClientInfo& c : clients)
     {
         if (c == to_refresh)
         {
-            c.timeout = clocker.now();
+            // Intervals from before the restart mean nothing, start their history over
+            if (c.recovered)
+                c.detector.restart(now);
+            else
+                c.detector.heartbeat(now);
+            c.recovered = false;
+            c.grace_until = {};
         }
     }
 }
 
-void send_list_to_all()
+// Clients plus upstream entries in one part, more than this doesn't fit in a frame
+static constexpr std::size_t clients_per_list_update = 16;
+// Only changed under clients_mutex
+static std::uint32_t lists_sent = 0;
+
+void send_list_to_all(hnoker::fanout& fan, const std::vector<Client>& upstream)
 {
     INFO("Starting list send")
-    std::array<char, 1024> write_buffer;
-    std::span<char> write_span{write_buffer.begin(), write_buffer.end()};
-
     Message cu_out{ MessageType::CONNECTOR_LIST_UPDATE };
-    std::vector<Client> client_list;
-    INFO("Current clients: {}", clients.size());
+    std::vector<Client> table;
+    std::vector<std::string> targets;
 
     {
-        // Copy these so we have a stable iterator
         std::lock_guard<std::mutex> clients_lock(clients_mutex);
+        subscriptions.set_upstream(upstream);
+        table = client_table();
         for (const ClientInfo& c : clients)
         {
-            client_list.emplace_back(c.client);
+            // Subscribers already got the change over their stream
+            if (!subscriptions.is_subscribed(c.client.ip))
+                targets.emplace_back(c.client.ip);
+        }
+        cu_out.cu.list_id = ++lists_sent;
+    }
+    INFO("Current clients: {}, {} without a subscription", table.size(), targets.size());
+    if (targets.empty())
+        return;
+
+    // Clients and upstream count together against the per part limit, clients first
+    const std::size_t total = table.size() + upstream.size();
+    const std::size_t parts = std::max<std::size_t>((total + clients_per_list_update - 1) / clients_per_list_update, 1);
+    cu_out.cu.parts = static_cast<std::uint16_t>(parts);
+    for (std::size_t part = 0; part < parts; part++)
+    {
+        const std::size_t first = std::min(part * clients_per_list_update, total);
+        const std::size_t last = std::min((part + 1) * clients_per_list_update, total);
+        cu_out.cu.clients.assign(table.begin() + std::min(first, table.size()), table.begin() + std::min(last, table.size()));
+        cu_out.cu.upstream.assign(upstream.begin() + (std::max(first, table.size()) - table.size()), upstream.begin() + (std::max(last, table.size()) - table.size()));
+        cu_out.cu.part = static_cast<std::uint16_t>(part);
+        try
+        {
+            // Queued sends of the same part of an older list are dropped, only the newest one matters
+            fan.send(targets, LISTENER_SERVER_PORT, cu_out, std::format("client_list {}", part), [part](const std::vector<hnoker::fanout_result>& results)
+            {
+                const auto delivered = std::count_if(results.begin(), results.end(), [](const hnoker::fanout_result& r) { return r.delivered; });
+                INFO("Client list part {} delivered to {}/{} clients", part, delivered, results.size());
+            });
+        }
+        catch (const std::exception& e)
+        {
+            // Better to miss one list than to take the whole connector down, the next change sends it again
+            WARN("Couldn't send the client list: {}", e.what());
+            return;
         }
     }
+}
 
-    cu_out.cu.clients = client_list;
+static hnoker::phi_accrual_detector make_detector(const connector_options& options)
+{
+    return hnoker::phi_accrual_detector{options.heartbeat_interval, options.min_std_deviation, options.acceptable_pause};
+}
 
-    INFO("Writing client list to buffer")
-    hnoker::write_message_to_buffer(write_span, cu_out);
-    INFO("Client list written to buffer");
-    hnoker::read_write_op_t op = [](std::span<char> xd, std::span<char> xd2, const std::string& xd3, std::uint16_t xd4)
+static void admit_client(Client client, RNG& rng, const connector_options& options, hnoker::fanout& fan, hnoker::connector_replication& replication, hnoker::region_tree& tree)
+{
+    bool added = false;
     {
-        return true;
-    };
+        std::lock_guard<std::mutex> clients_lock(clients_mutex);
+        if (std::find(clients.begin(), clients.end(), client) == clients.end())
+        {
+            client.bully_id = rng.get();
+            clients.emplace_back(client, make_detector(options));
+            membership_on_disk.added(client);
+            subscriptions.joined(client, client_table());
+            compact_log_if_needed();
+            added = true;
+        }
+    }
+
+    if (added)
+    {
+        INFO("New client {} was added to list, sending new list to all", client.ip)
+        replication.membership_changed();
+
+        Message cl = { MessageType::CONNECTOR_LIST };
+        cl.cl.bully_id = client.bully_id;
+        cl.cl.upstream = tree.upstream();
+
+        try
+        {
+            fan.send({client.ip}, LISTENER_SERVER_PORT, cl, "", [](const std::vector<hnoker::fanout_result>& results)
+            {
+                if (!results.front().delivered)
+                    INFO("Timed out while sending CONNECTOR_LIST to {}", results.front().ip);
+            });
+        }
+        catch (const std::exception& e)
+        {
+            // They still get their id over the membership stream
+            WARN("Couldn't send CONNECTOR_LIST to {}: {}", client.ip, e.what());
+        }
+
+        send_list_to_all(fan, tree.upstream());
+    }
+}
+
+struct admission_control {
+    admission_control(const admission_options& options) :
+        options(options),
+        global(options.global_rate, options.global_burst)
+    {}
+
+    admission_options options;
+    std::mutex mutex;
+    std::condition_variable_any wake;
+    hnoker::token_bucket global;
+    std::unordered_map<std::string, hnoker::token_bucket> per_ip;
+    std::deque<Client> queued;
+};
+
+static void reject_join(const std::string& ip, std::chrono::milliseconds retry_after, hnoker::fanout& fan)
+{
+    INFO("Turning away join from {}, retry after {} ms", ip, retry_after.count());
+    Message cn{ MessageType::CONNECT };
+    cn.cn.retry_after_ms = static_cast<std::uint32_t>(std::max<long long>(retry_after.count(), 1));
+    fan.send({ip}, LISTENER_SERVER_PORT, cn);
+}
+
+// Joins over the per source budget are turned away, joins over the global budget
+// wait in a bounded queue that the admitter drains at the global rate
+static void request_join(admission_control& admission, const Client& client, hnoker::fanout& fan)
+{
+    const auto now = clocker.now();
+    std::unique_lock<std::mutex> lock(admission.mutex);
+
+    // Already waiting its turn, a repeat doesn't cost it anything
+    if (std::find(admission.queued.begin(), admission.queued.end(), client) != admission.queued.end())
+        return;
+
+    const admission_options& ao = admission.options;
+    auto [it, inserted] = admission.per_ip.try_emplace(client.ip, ao.per_ip_rate, ao.per_ip_burst, now);
+    if (!it->second.try_take(now))
+    {
+        auto retry_after = it->second.time_until_available(now);
+        lock.unlock();
+        reject_join(client.ip, retry_after, fan);
+        return;
+    }
+
+    if (admission.queued.size() >= ao.max_queued_joins)
+    {
+        // Everyone ahead of them still has to get in first
+        auto retry_after = std::chrono::milliseconds(static_cast<long long>(1000.0 * admission.queued.size() / ao.global_rate));
+        lock.unlock();
+        reject_join(client.ip, retry_after, fan);
+        return;
+    }
+
+    admission.queued.push_back(client);
+    if (admission.queued.size() > 1)
+        INFO("Join from {} queued, {} joins waiting", client.ip, admission.queued.size());
+    admission.wake.notify_one();
+}
+
+static void run_admission_queue(std::stop_token st, admission_control& admission, RNG& rng, const connector_options& options, hnoker::fanout& fan, hnoker::connector_replication& replication, hnoker::region_tree& tree)
+{
+    while (!st.stop_requested())
+    {
+        Client next;
+        {
+            std::unique_lock<std::mutex> lock(admission.mutex);
+            if (!admission.wake.wait(lock, st, [&]() { return !admission.queued.empty(); }))
+                return;
+
+            const auto now = clocker.now();
+            if (!admission.global.try_take(now))
+            {
+                auto wait = admission.global.time_until_available(now);
+                lock.unlock();
+                std::this_thread::sleep_for(wait);
+                continue;
+            }
+
+            next = admission.queued.front();
+            admission.queued.pop_front();
+
+            // Forget sources that have been quiet long enough to have a full bucket again
+            std::erase_if(admission.per_ip, [&](auto& entry) { return entry.second.is_full(now); });
+        }
+        admit_client(next, rng, options, fan, replication, tree);
+    }
+}
+
+static void remove_failed_clients(const Gossip& gs)
+{
+    std::lock_guard<std::mutex> clients_lock(clients_mutex);
+    for (const MemberUpdate& u : gs.updates)
+    {
+        if (u.state == MemberState::DEAD)
+            remove_client(u.client);
+    }
+}
 
-    hnoker::network bombardment;
-    for (const Client& c : client_list)
+// Standby side, take the primary's table but keep heartbeat history for clients we already knew
+static void install_replicated_clients(const std::vector<Client>& replicated, const connector_options& options)
+{
+    std::lock_guard<std::mutex> clients_lock(clients_mutex);
+    std::vector<ClientInfo> installed;
+    installed.reserve(replicated.size());
+    for (const Client& c : replicated)
+    {
+        auto it = std::find(clients.begin(), clients.end(), c);
+        if (it != clients.end())
+            installed.emplace_back(c, std::move(it->detector));
+        else
+            installed.emplace_back(c, make_detector(options));
+    }
+    clients = std::move(installed);
+    subscriptions.resync(replicated);
+
+    // A standby that restarts comes back with the last table it was sent
+    if (membership_on_disk.enabled())
+        membership_on_disk.compact(replicated);
+}
+
+static void reset_detectors(const connector_options& options)
+{
+    // Freshly promoted, give everyone a full timeout to find us before evicting
+    std::lock_guard<std::mutex> clients_lock(clients_mutex);
+    for (ClientInfo& c : clients)
+        c.detector = make_detector(options);
+    INFO("Took over {} clients from the replicated table", clients.size());
+}
+
+static std::size_t recover_clients(const connector_options& options)
+{
+    std::lock_guard<std::mutex> clients_lock(clients_mutex);
+    std::vector<Client> recovered = membership_on_disk.open(options.persistence);
+    const auto grace_until = clocker.now() + options.persistence.grace_period;
+    for (const Client& c : recovered)
+        clients.emplace_back(c, make_detector(options), grace_until, true);
+    return recovered.size();
+}
+
+static void probe_recovered(hnoker::fanout& fan)
+{
+    std::vector<std::string> targets;
+    const auto now = clocker.now();
     {
-        INFO("Client: {}", c.ip)
-        bombardment.async_connect_server(c.ip, LISTENER_SERVER_PORT, std::span<char>(), write_buffer, op, hnoker::default_timeout_handler);
+        std::lock_guard<std::mutex> clients_lock(clients_mutex);
+        for (const ClientInfo& c : clients)
+        {
+            if (c.recovered && now < c.grace_until)
+                targets.push_back(c.client.ip);
+        }
     }
-    bombardment.run();
+
+    if (targets.empty())
+        return;
+
+    // Their answer is a SEND_STATUS, which counts as hearing from them
+    Message qs{ MessageType::QUERY_STATUS };
+    fan.send(targets, LISTENER_SERVER_PORT, qs, "recovery_probe");
 }
 
-void start_connector()
+static void record_playback(const std::string& ip, const Message& status, const Client& client)
+{
+    const auto now = clocker.now();
+    if (status.type == MessageType::HEARTBEAT)
+        playback.update(ip, client.rank, client.bully_id, status.hb.current_song_id, status.hb.elapsed_ms, status.hb.paused, now);
+    else
+        playback.update(ip, client.rank, client.bully_id, status.ss.current_song_id, status.ss.elapsed_time * 1000, status.ss.paused, now);
+}
+
+static void log_room_health(const connector_options& options)
+{
+    const hnoker::room_health h = playback.health();
+    if (h.members == 0)
+        return;
+
+    const auto desynced = playback.desynced(options.desync_tolerance);
+    INFO("Room health: {} members, {} paused, {} on song {} of {} songs, max drift {} ms, {} desynced",
+        h.members, h.paused, h.on_leader_song, h.leader_song, h.songs, h.max_drift.count(), desynced.size());
+    for (const std::string& ip : desynced)
+        INFO("  {} is out of sync with the leader", ip);
+}
+
+static std::vector<Client> snapshot_clients()
+{
+    std::lock_guard<std::mutex> clients_lock(clients_mutex);
+    return client_table();
+}
+
+void start_connector(const connector_options& options)
 {
     INFO("Starting connector")
-    std::array<char, 1024> read_buffer;
-    std::array<char, 1024> write_buffer;
 
     RNG rng{};
     clients = std::vector<ClientInfo>();
+    const std::size_t recovered = recover_clients(options);
+
+    // Everything outbound goes through here so the accept loop never waits on a listener
+    hnoker::fanout fan{options.fanout};
 
-    hnoker::read_write_op_t handle_message = [&rng](std::span<char> read_buffer, std::span<char> write_buffer, const std::string& ip, const std::uint16_t& port) -> bool
+    hnoker::lease_grantor leases{options.lease};
+
+    hnoker::replication_callbacks callbacks;
+    callbacks.snapshot = snapshot_clients;
+    callbacks.install = [&options](const std::vector<Client>& replicated) { install_replicated_clients(replicated, options); };
+    callbacks.refresh = [](const std::vector<Client>& heard)
+    {
+        std::lock_guard<std::mutex> clients_lock(clients_mutex);
+        for (const Client& c : heard)
+            refresh_timeout(c);
+    };
+    callbacks.promoted = [&options, &leases]()
+    {
+        reset_detectors(options);
+        leases.promoted(clocker.now());
+    };
+    hnoker::connector_replication replication{options.replication, fan, std::move(callbacks)};
+
+    hnoker::region_callbacks region_callbacks;
+    region_callbacks.local_members = snapshot_clients;
+    region_callbacks.active = [&replication]() { return replication.is_primary(); };
+    region_callbacks.upstream_changed = [&fan](const std::vector<Client>& upstream) { send_list_to_all(fan, upstream); };
+    hnoker::region_tree tree{options.region, options.port, fan, std::move(region_callbacks)};
+
+    admission_control admission{options.admission};
+    std::jthread admitter{[&](std::stop_token st) { run_admission_queue(st, admission, rng, options, fan, replication, tree); }};
+
+    hnoker::stream_op_t handle_message = [&admission, &options, &fan, &replication, &tree, &leases](std::span<char> read_buffer, std::span<char>, const std::string& ip, std::uint16_t port, const hnoker::channel_ptr& channel) -> bool
     {
         INFO("Connector received message from {}:{}", ip, port)
         MessageType message_type = static_cast<MessageType>(read_buffer[0]);
 
-        std::uint16_t bully_id = rng.get();
-        Client client{ip, port, rng.get()};
-
-        hnoker::network net;
+        Client client{ip, port, 0};
 
-        if (message_type == MessageType::CONNECT)
+        if (message_type == MessageType::REPLICA_SYNC)
         {
-            INFO("Message type was CONNECT")
+            Message rs = hnoker::read_message_from_buffer(read_buffer);
+            replication.handle_sync(rs.rs);
+        }
+        else if (message_type == MessageType::REGION_SUMMARY)
+        {
+            Message su = hnoker::read_message_from_buffer(read_buffer);
+            tree.handle_summary(su.su, ip);
+        }
+        else if (message_type == MessageType::SUBSCRIBE)
+        {
+            Message sb = hnoker::read_message_from_buffer(read_buffer);
+            std::lock_guard<std::mutex> clients_lock(clients_mutex);
+            subscriptions.subscribe(ip, sb.sb, channel, client_table());
+            refresh_timeout(client);
+        }
+        else if (message_type == MessageType::SEND_STATUS || message_type == MessageType::HEARTBEAT)
+        {
+            Message status = hnoker::read_message_from_buffer(read_buffer);
 
-            bool added = false;
+            bool rank_changed = false;
             {
+                // Standbys keep their copy warm too, and tell the primary who they heard from
                 std::lock_guard<std::mutex> clients_lock(clients_mutex);
-                if (std::find(clients.begin(), clients.end(), client) == clients.end())
+                refresh_timeout(client);
+                replication.heard_from(client);
+
+                auto known = std::find(clients.begin(), clients.end(), client);
+                if (known != clients.end())
                 {
-                    clients.emplace_back(std::move(client), create_knocker(ip, port));
-                    added = true;
+                    // Listeners elect by rank, so they all need to see the same one
+                    if (message_type == MessageType::HEARTBEAT && replication.is_primary() && known->client.rank != status.hb.rank)
+                    {
+                        known->client.rank = status.hb.rank;
+                        subscriptions.updated(known->client);
+                        rank_changed = true;
+                    }
+                    record_playback(ip, status, known->client);
+
+                    // Every request gets an answer, granted or not, so the listener can match them up
+                    if (message_type == MessageType::HEARTBEAT && replication.is_primary() && status.hb.wants_lease)
+                    {
+                        const auto answer = leases.request(known->client, clocker.now());
+                        Message ls{ MessageType::LEASE };
+                        ls.ls = answer.lease;
+                        channel->send(hnoker::make_frame(ls));
+                        if (answer.changed)
+                            subscriptions.push(ls, ip);
+                    }
+                    else if (message_type == MessageType::HEARTBEAT && replication.is_primary() && status.hb.hand_lease_to != 0)
+                    {
+                        auto successor = std::find_if(clients.begin(), clients.end(), [&](const ClientInfo& c) { return c.client.bully_id == status.hb.hand_lease_to; });
+                        if (successor != clients.end())
+                        {
+                            const auto answer = leases.hand_over(known->client, successor->client, clocker.now());
+                            if (answer.changed)
+                            {
+                                Message ls{ MessageType::LEASE };
+                                ls.ls = answer.lease;
+                                channel->send(hnoker::make_frame(ls));
+                                subscriptions.push(ls, ip);
+                            }
+                        }
+                    }
                 }
             }
 
-            if (added)
+            if (rank_changed)
             {
-                INFO("New client {} was added to list, sending new list to all", ip)
-
-                Message cl = { MessageType::CONNECTOR_LIST };
-                cl.cl.bully_id = bully_id;
-
-                std::function msg = [&cl](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
-                {
-                    hnoker::write_message_to_buffer(write_buf, cl);
-                    return false;
-                };
-
-                hnoker::timeout_handler th = []()
+                replication.membership_changed();
+                send_list_to_all(fan, tree.upstream());
+            }
+        }
+        else if (!replication.is_primary())
+        {
+            if (message_type == MessageType::CONNECT)
+            {
+                bool known;
                 {
-                    INFO("Timed out while sending CONNECTOR_LIST");
-                };
-
-                net.async_connect_server(ip, LISTENER_SERVER_PORT, read_buffer, write_buffer, msg, th);
-                net.run();
-
-                send_list_to_all();
+                    std::lock_guard<std::mutex> clients_lock(clients_mutex);
+                    known = std::find(clients.begin(), clients.end(), client) != clients.end();
+                }
+                if (!known)
+                    reject_join(ip, options.replication.failover_timeout, fan);
             }
         }
+        else if (message_type == MessageType::CONNECT)
+        {
+            INFO("Message type was CONNECT")
+            request_join(admission, client, fan);
+        }
         else if (message_type == MessageType::DISCONNECT)
         {
             INFO("Message type was DISCONNECT")
@@ -206,40 +555,83 @@ void start_connector()
                 std::lock_guard<std::mutex> clients_lock(clients_mutex);
                 remove_client(client);
             }
-            send_list_to_all();
+            replication.membership_changed();
+            send_list_to_all(fan, tree.upstream());
         }
-        else if (message_type == MessageType::SEND_STATUS)
+        else if (message_type == MessageType::GOSSIP)
         {
-            INFO("Message type was SEND_STATUS")
-            refresh_timeout(client);
+            INFO("Message type was GOSSIP")
+            // Failures found by the listeners, they already gossip it among themselves
+            Message gs = hnoker::read_message_from_buffer(read_buffer);
+            if (gs.gs.gt != GossipType::REPORT)
+                return false;
+            remove_failed_clients(gs.gs);
+            replication.membership_changed();
         }
         return false;
     };
 
     hnoker::network network;
-    std::jthread xd{[&]() { network.async_create_server(CONNECTOR_SERVER_PORT, read_buffer, write_buffer, handle_message, hnoker::default_timeout_handler); INFO("Connector receiving messages"); network.run(); }};
+    std::jthread xd{[&]() { network.async_create_stream_server(options.port, handle_message, hnoker::default_timeout_handler); INFO("Connector receiving messages"); network.run(); }};
     xd.detach();
 
+    replication.start();
+    tree.start();
 
+    if (recovered > 0)
+    {
+        // Their lists are stale but their bully ids are still valid, let them know we are back
+        INFO("Probing {} recovered members for {} ms before any are evicted", recovered, options.persistence.grace_period.count());
+        replication.membership_changed();
+        send_list_to_all(fan, tree.upstream());
+    }
+
+    auto last_health_log = clocker.now();
     while (true)
     {
-        std::this_thread::sleep_for(std::chrono::seconds(2));
-        INFO("Cleaning up timed out clients")
+        std::this_thread::sleep_for(options.sweep_interval);
+
+        if (clocker.now() - last_health_log >= options.health_log_interval)
+        {
+            log_room_health(options);
+            last_health_log = clocker.now();
+        }
+
+        if (options.gossip || !replication.is_primary())
+            continue;
+
+        probe_recovered(fan);
+
         auto now = clocker.now();
-        const auto past_timeout = [&](const ClientInfo& c)
+        const auto suspected = [&](const ClientInfo& c)
         {
-            return (c.timeout + std::chrono::seconds(3)) < now;
+            if (now < c.grace_until)
+                return false;
+            return !c.detector.is_available(now, options.phi_threshold);
         };
 
         size_t number_erased;
         {
             std::lock_guard<std::mutex> clients_lock(clients_mutex);
-            number_erased = std::erase_if(clients, past_timeout);
+            for (const ClientInfo& c : clients)
+            {
+                if (suspected(c))
+                {
+                    INFO("Evicting {}, phi {:.2f} over threshold {:.2f}", c.client.ip, c.detector.phi(now), options.phi_threshold);
+                    membership_on_disk.removed(c.client);
+                    subscriptions.left(c.client);
+                    playback.remove(c.client.ip);
+                }
+            }
+            number_erased = std::erase_if(clients, suspected);
+            compact_log_if_needed();
         }
+
         if (number_erased > 0)
         {
             INFO("Some timed out clients were removed, sending new list to remaining clients");
-            send_list_to_all();
+            replication.membership_changed();
+            send_list_to_all(fan, tree.upstream());
         }
     }
 }
@@ -1,3 +1,53 @@
 #pragma once
 
-void start_connector();
+#include "fanout.hpp"
+#include "lease.hpp"
+#include "membership_log.hpp"
+#include "networking.hpp"
+#include "region.hpp"
+#include "replication.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+struct admission_options
+{
+    // Joins per second from one source, and how many it may burst
+    double per_ip_rate = 0.5;
+    double per_ip_burst = 3.0;
+    // Joins per second the connector admits in total
+    double global_rate = 20.0;
+    double global_burst = 20.0;
+    std::size_t max_queued_joins = 256;
+};
+
+struct connector_options
+{
+    std::uint16_t port = CONNECTOR_SERVER_PORT;
+
+    // Listeners detect failures among themselves with gossip, the connector only handles joins
+    bool gossip = false;
+
+    // Clients are evicted once the phi accrual suspicion level goes over this
+    double phi_threshold = 8.0;
+    std::chrono::milliseconds heartbeat_interval{HEARTBEAT_INTERVAL_MS};
+    std::chrono::milliseconds sweep_interval{500};
+    std::chrono::milliseconds min_std_deviation{200};
+    std::chrono::milliseconds acceptable_pause{500};
+
+    // Room health from the members' playback reports is logged this often
+    std::chrono::milliseconds health_log_interval{10000};
+    // Members further than this from the leader's position count as desynced
+    std::chrono::milliseconds desync_tolerance{250};
+
+    hnoker::fanout_options fanout{};
+    admission_options admission{};
+    hnoker::replication_options replication{};
+    hnoker::region_options region{};
+    hnoker::persistence_options persistence{};
+    // Only one listener at a time may act as the leader, it keeps asking for this lease
+    hnoker::lease_options lease{};
+};
+
+void start_connector(const connector_options& options = {});
@@ -0,0 +1,478 @@
+#include "election.hpp"
+#include "logging.hpp"
+#include "networking.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+
+namespace hnoker
+{
+    bully_election::bully_election(const election_options& options) :
+        options(options),
+        fan(fanout_options{32, options.answer_timeout})
+    {}
+
+    bully_election::~bully_election()
+    {
+        thread.request_stop();
+    }
+
+    void bully_election::start(std::uint16_t id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (my_id == id)
+                return;
+            my_id = id;
+            // Give a sitting leader one timeout to announce itself before we bully anyone
+            state = phase::FOLLOWER;
+            last_heard_leader = clock::now();
+            rebuild_view();
+        }
+
+        INFO("Starting bully election, bully_id: {}", id);
+        if (!thread.joinable())
+            thread = std::jthread{[this](std::stop_token st) { run(st); }};
+    }
+
+    void bully_election::set_peers(const std::vector<Client>& new_local, const std::vector<Client>& new_upstream)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        local = new_local;
+        upstream = new_upstream;
+        rebuild_view();
+    }
+
+    std::uint16_t bully_election::leader_id() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return leader;
+    }
+
+    bool bully_election::is_leader() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return state == phase::LEADER || state == phase::HANDING_OFF;
+    }
+
+    std::shared_ptr<const coordinator_view> bully_election::view() const
+    {
+        // Both sides are seq_cst, a rebuild that finds no readers after its swap knows nobody still holds the old pointer
+        view_readers.fetch_add(1);
+        std::shared_ptr<const coordinator_view> v = *current_view.load();
+        view_readers.fetch_sub(1);
+        return v;
+    }
+
+    void bully_election::handle_message(const Bully& bl, const std::string& sender_ip)
+    {
+        const auto now = clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (my_id == 0)
+            return;
+
+        switch (bl.et)
+        {
+            case BullyType::ELECTION:
+                // Having just handed off we let them have it
+                if (!outranks(my_rank(), my_id, bl.sender_rank, bl.sender_id) || stepped_down(now))
+                    break;
+                send({sender_ip}, BullyType::ANSWER, my_id, my_rank());
+                if (state == phase::LEADER)
+                    send({sender_ip}, BullyType::VICTORY, my_id, my_rank());
+                else if (state == phase::FOLLOWER)
+                    begin_election(now);
+                break;
+            case BullyType::ANSWER:
+                if (state == phase::ELECTING && outranks(bl.sender_rank, bl.sender_id, my_rank(), my_id))
+                {
+                    state = phase::WAITING_FOR_VICTORY;
+                    phase_started = now;
+                }
+                break;
+            case BullyType::PROBE:
+                break;
+            case BullyType::HANDOFF:
+                if (bl.sender_id == leader && state != phase::LEADER)
+                {
+                    INFO("Leader {} handed leadership over to us", bl.sender_id);
+                    become_leader(now);
+                }
+                break;
+            case BullyType::VICTORY:
+                if (outranks(bl.sender_rank, bl.sender_id, my_rank(), my_id) || (stepped_down(now) && bl.sender_id != my_id))
+                {
+                    follow(bl.sender_id, now);
+                    // Our region only hears the leaders of other regions through us
+                    if (is_region_leader() && std::none_of(local.begin(), local.end(), [&](const Client& c) { return c.bully_id == bl.sender_id; }))
+                        send(everyone_in(local), BullyType::VICTORY, bl.sender_id, bl.sender_rank, "victory");
+                }
+                else if (bl.sender_id != my_id && !stepped_down(now))
+                {
+                    // We outrank whoever that is
+                    if (state == phase::LEADER)
+                        send({sender_ip}, BullyType::VICTORY, my_id, my_rank());
+                    else if (state == phase::FOLLOWER)
+                        begin_election(now);
+                }
+                break;
+        }
+        wake.notify_one();
+    }
+
+    void bully_election::run(std::stop_token st)
+    {
+        const auto tick = std::max(std::chrono::milliseconds(5), std::min(options.victory_interval, options.answer_timeout) / 4);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!st.stop_requested())
+        {
+            const auto before = clock::now();
+            const bool timed_out = wake.wait_for(lock, tick) == std::cv_status::timeout;
+            const auto now = clock::now();
+
+            // A busy machine wakes up late, that is our load figure
+            if (timed_out)
+            {
+                const double lag = std::max(0.0, std::chrono::duration<double, std::milli>(now - before - tick).count());
+                scheduling_lag_ms += 0.1 * (lag - scheduling_lag_ms);
+            }
+
+            if (now - last_probe >= options.probe_interval)
+            {
+                probe_peers();
+                last_probe = now;
+            }
+
+            switch (state)
+            {
+                case phase::FOLLOWER:
+                    if (now - last_heard_leader > options.leader_timeout)
+                    {
+                        INFO("No VICTORY from leader {} in {} ms, starting an election", leader, options.leader_timeout.count());
+                        begin_election(now);
+                    }
+                    break;
+                case phase::ELECTING:
+                    if (now - phase_started > options.answer_timeout)
+                        become_leader(now);
+                    break;
+                case phase::WAITING_FOR_VICTORY:
+                    if (now - phase_started > options.victory_timeout)
+                        begin_election(now);
+                    break;
+                case phase::HANDING_OFF:
+                    break;
+                case phase::LEADER:
+                    if (options.hand_off_when_busy && busy_sync && scheduling_lag_ms > static_cast<double>(options.max_scheduling_lag.count()))
+                    {
+                        INFO("Leader is lagging {:.1f} ms behind, handing off", scheduling_lag_ms);
+                        if (hand_off(lock, busy_sync))
+                            break;
+                    }
+                    if (now - last_victory_sent >= options.victory_interval)
+                    {
+                        auto targets = everyone_in(local);
+                        auto others = everyone_in(upstream);
+                        targets.insert(targets.end(), others.begin(), others.end());
+                        send(targets, BullyType::VICTORY, my_id, my_rank(), "victory");
+                        last_victory_sent = now;
+                    }
+                    break;
+            }
+        }
+    }
+
+    void bully_election::set_handoff_sync(handoff_sync sync)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy_sync = std::move(sync);
+    }
+
+    bool bully_election::hand_off(const handoff_sync& sync)
+    {
+        auto announced = std::make_shared<std::promise<void>>();
+        auto done = announced->get_future();
+        std::unique_lock<std::mutex> lock(mutex);
+        const bool handed = hand_off(lock, sync, announced);
+        wake.notify_one();
+        lock.unlock();
+
+        if (handed && done.wait_for(options.answer_timeout * 3) == std::future_status::timeout)
+            INFO("Gave up waiting for the handoff to be announced");
+        return handed;
+    }
+
+    bool bully_election::hand_off(std::unique_lock<std::mutex>& lock, const handoff_sync& sync, std::shared_ptr<std::promise<void>> announced)
+    {
+        if (state != phase::LEADER)
+            return false;
+
+        const Client* best = nullptr;
+        for (const Client& c : local)
+        {
+            if (c.bully_id != my_id && (!best || outranks(c, *best)))
+                best = &c;
+        }
+        if (!best)
+            return false;
+
+        const Client next = *best;
+        INFO("Handing leadership over to {} at {}", next.bully_id, next.ip);
+        state = phase::HANDING_OFF;
+
+        // The sync talks to the network, keep the handlers going meanwhile
+        lock.unlock();
+        if (sync)
+            sync(next);
+        lock.lock();
+
+        // A VICTORY from someone better got here first
+        if (state != phase::HANDING_OFF)
+            return false;
+
+        const auto now = clock::now();
+        successor_ip = next.ip;
+        handed_off_at = now;
+        follow(next.bully_id, now);
+
+        // Announce the successor only once it knows, so nobody sends it commands while it thinks it follows
+        auto others = everyone_in(local);
+        auto others_upstream = everyone_in(upstream);
+        others.insert(others.end(), others_upstream.begin(), others_upstream.end());
+        std::erase(others, next.ip);
+        send({next.ip}, BullyType::HANDOFF, my_id, my_rank(), "", [this, next, others, announced](const std::vector<fanout_result>& results)
+        {
+            if (!results.front().delivered)
+                INFO("HANDOFF to {} was not delivered, the room will elect someone", next.ip);
+            if (others.empty())
+            {
+                if (announced)
+                    announced->set_value();
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            send(others, BullyType::VICTORY, next.bully_id, next.rank, "victory", [announced](const std::vector<fanout_result>&)
+            {
+                if (announced)
+                    announced->set_value();
+            });
+        });
+        return true;
+    }
+
+    std::string bully_election::handed_off_to() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (successor_ip.empty() || clock::now() - handed_off_at > options.handoff_forward)
+            return "";
+        return successor_ip;
+    }
+
+    bool bully_election::stepped_down(clock::time_point now) const
+    {
+        return !successor_ip.empty() && now - handed_off_at < options.handoff_hold;
+    }
+
+    void bully_election::begin_election(clock::time_point now)
+    {
+        state = phase::ELECTING;
+        phase_started = now;
+
+        auto higher = ips_above_us(local);
+        auto higher_upstream = ips_above_us(upstream);
+        higher.insert(higher.end(), higher_upstream.begin(), higher_upstream.end());
+        if (higher.empty())
+        {
+            become_leader(now);
+            return;
+        }
+        send(higher, BullyType::ELECTION, my_id, my_rank());
+    }
+
+    void bully_election::become_leader(clock::time_point now)
+    {
+        if (leader != my_id)
+        {
+            if (leader != 0)
+                INFO("Took over from leader {}, {} ms after last hearing from it", leader, std::chrono::duration_cast<std::chrono::milliseconds>(now - last_heard_leader).count())
+            else
+                INFO("No one higher answered, bully_id {} is the leader", my_id)
+        }
+        state = phase::LEADER;
+        leader = my_id;
+        last_heard_leader = now;
+        rebuild_view();
+        // Announce on the next tick
+        last_victory_sent = {};
+    }
+
+    void bully_election::follow(std::uint16_t id, clock::time_point now)
+    {
+        if (leader != id)
+        {
+            if (leader != 0 && leader != my_id)
+                INFO("Leader {} replaced by {}, {} ms after last hearing from the old one", leader, id, std::chrono::duration_cast<std::chrono::milliseconds>(now - last_heard_leader).count())
+            else
+                INFO("Following leader {}", id)
+        }
+        state = phase::FOLLOWER;
+        const bool changed = leader != id;
+        leader = id;
+        last_heard_leader = now;
+        // Every VICTORY ends up here, only rebuild when it names someone new
+        if (changed)
+            rebuild_view();
+    }
+
+    bool bully_election::is_region_leader() const
+    {
+        return ips_above_us(local).empty();
+    }
+
+    std::uint16_t bully_election::my_rank() const
+    {
+        // Go by what the connector handed out so everyone compares the same numbers
+        for (const Client& c : local)
+        {
+            if (c.bully_id == my_id)
+                return c.rank;
+        }
+        return 0;
+    }
+
+    void bully_election::probe_peers()
+    {
+        auto targets = everyone_in(local);
+        std::erase_if(peer_rtt_ms, [&](const auto& p) { return std::find(targets.begin(), targets.end(), p.first) == targets.end(); });
+        if (targets.empty())
+            return;
+
+        send(targets, BullyType::PROBE, my_id, my_rank(), "", [this](const std::vector<fanout_result>& results)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const fanout_result& r : results)
+            {
+                // Not getting through in time counts as the worst round trip we can tell apart
+                const double sample = r.delivered ? static_cast<double>(r.took.count()) : static_cast<double>(options.answer_timeout.count());
+                auto [it, inserted] = peer_rtt_ms.try_emplace(r.ip, sample);
+                if (!inserted)
+                    it->second += 0.25 * (sample - it->second);
+            }
+            update_rank();
+        });
+    }
+
+    void bully_election::update_rank()
+    {
+        if (peer_rtt_ms.empty())
+            return;
+
+        std::vector<double> rtts;
+        for (const auto& [ip, rtt] : peer_rtt_ms)
+            rtts.push_back(rtt);
+        auto middle = rtts.begin() + rtts.size() / 2;
+        std::nth_element(rtts.begin(), middle, rtts.end());
+
+        // Everyone with spare capacity ranks above everyone without, then the lower median round trip wins
+        constexpr std::uint16_t buckets = 1000;
+        const bool busy = scheduling_lag_ms > static_cast<double>(options.max_scheduling_lag.count());
+        const auto bucket = std::min<std::uint16_t>(buckets - 1, static_cast<std::uint16_t>(std::min(*middle / static_cast<double>(options.rtt_bucket.count()), double(buckets))));
+        const std::uint16_t rank = (busy ? 1 : 1 + buckets) + (buckets - 1 - bucket);
+
+        // Only move by more than a bucket, otherwise jitter keeps shuffling the leader
+        const bool was_busy = reported_rank != 0 && reported_rank <= buckets;
+        if (reported_rank == 0 || busy != was_busy || std::abs(int(rank) - int(reported_rank)) > 1)
+        {
+            if (reported_rank != rank)
+                INFO("Leader rank now {}, median round trip {:.1f} ms, scheduling lag {:.1f} ms", rank, *middle, scheduling_lag_ms);
+            reported_rank = rank;
+        }
+    }
+
+    std::uint16_t bully_election::own_rank() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return reported_rank;
+    }
+
+    void bully_election::rebuild_view()
+    {
+        auto v = std::make_shared<coordinator_view>();
+        v->epoch = ++view_epoch;
+        v->my_id = my_id;
+        v->leader_id = leader;
+        if (v->leader_id == 0)
+        {
+            // No result yet, with a connector tree the best ranked can be in another region
+            const Client* best = nullptr;
+            for (const auto* clients : {&local, &upstream})
+                for (const Client& c : *clients)
+                    if (!best || outranks(c, *best))
+                        best = &c;
+            if (best)
+                v->leader_id = best->bully_id;
+        }
+
+        for (const auto* clients : {&local, &upstream})
+        {
+            for (const Client& c : *clients)
+            {
+                if (v->leader_id != 0 && c.bully_id == v->leader_id && v->leader_ip.empty())
+                    v->leader_ip = c.ip;
+            }
+        }
+        for (const Client& c : local)
+            v->local_ips.insert(c.ip);
+        for (const Client& c : upstream)
+            v->upstream_ips.insert(c.ip);
+        const Client* region_best = nullptr;
+        for (const Client& c : local)
+            if (!region_best || outranks(c, *region_best))
+                region_best = &c;
+        if (region_best)
+            v->region_leader_ip = region_best->ip;
+
+        v->is_coordinator = my_id != 0 && v->leader_id == my_id;
+        v->is_region_leader = my_id != 0 && is_region_leader();
+        published.push_back(std::move(v));
+        current_view.store(&published.back());
+        // Readers that come in from now on only see the new one, so the rest can go once the ones in flight are done
+        if (view_readers.load() == 0)
+            published.erase(published.begin(), std::prev(published.end()));
+    }
+
+    std::vector<std::string> bully_election::everyone_in(const std::vector<Client>& clients) const
+    {
+        std::vector<std::string> ips;
+        for (const Client& c : clients)
+        {
+            if (c.bully_id != my_id)
+                ips.push_back(c.ip);
+        }
+        return ips;
+    }
+
+    std::vector<std::string> bully_election::ips_above_us(const std::vector<Client>& clients) const
+    {
+        const std::uint16_t rank = my_rank();
+        std::vector<std::string> ips;
+        for (const Client& c : clients)
+        {
+            if (c.bully_id != my_id && outranks(c.rank, c.bully_id, rank, my_id))
+                ips.push_back(c.ip);
+        }
+        return ips;
+    }
+
+    void bully_election::send(const std::vector<std::string>& targets, BullyType type, std::uint16_t sender_id, std::uint16_t sender_rank, const std::string& key, fanout_done done)
+    {
+        if (targets.empty())
+            return;
+        Message msg{ MessageType::BULLY };
+        msg.bl.et = type;
+        msg.bl.sender_id = sender_id;
+        msg.bl.sender_rank = sender_rank;
+        fan.send(targets, LISTENER_SERVER_PORT, msg, key, std::move(done));
+    }
+}
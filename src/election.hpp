@@ -0,0 +1,170 @@
+#pragma once
+
+#include "fanout.hpp"
+#include "message_types.hpp"
+
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace hnoker
+{
+    struct election_options
+    {
+        // How often the leader announces itself, followers treat it as the leader's heartbeat
+        std::chrono::milliseconds victory_interval{100};
+        // Silence from the leader for this long starts an election
+        std::chrono::milliseconds leader_timeout{350};
+        // Nobody higher answering an ELECTION within this makes us the leader
+        std::chrono::milliseconds answer_timeout{100};
+        // Someone higher answered but never declared victory, try again
+        std::chrono::milliseconds victory_timeout{250};
+
+        // Round trips to the rest of the room are timed this often to rank candidates
+        std::chrono::milliseconds probe_interval{2000};
+        // Median round trips within the same bucket rank the same
+        std::chrono::milliseconds rtt_bucket{10};
+        // Waking up later than this on average means the machine is too busy to lead
+        std::chrono::milliseconds max_scheduling_lag{20};
+
+        // A busy leader hands over to the next best listener instead of waiting to be outranked
+        bool hand_off_when_busy = true;
+        // After handing off, commands that still reach us go on to the successor for this long
+        std::chrono::milliseconds handoff_forward{1000};
+        // and we don't contend for leadership again for this long
+        std::chrono::milliseconds handoff_hold{30000};
+    };
+
+    // Who leads, worked out once per membership or election change so the
+    // message handlers don't have to scan the client lists
+    struct coordinator_view
+    {
+        // Bumped on every rebuild
+        std::uint64_t epoch = 0;
+        std::uint16_t my_id = 0;
+        std::uint16_t leader_id = 0;
+        std::string leader_ip;
+        bool is_coordinator = false;
+        bool is_region_leader = false;
+        // Who relays the leader's pushes into our region, can be us
+        std::string region_leader_ip;
+        std::unordered_set<std::string> local_ips;
+        std::unordered_set<std::string> upstream_ips;
+    };
+
+    // Bully election among the listeners. The best ranked listener that is alive
+    // wins, and keeps announcing VICTORY so the others notice within leader_timeout
+    // when it is gone instead of waiting for the connector to evict it.
+    //
+    // Every listener times round trips to its region and watches its own
+    // scheduling lag, and reports a rank from those with its heartbeats. The
+    // connector hands the ranks out with the member lists, so all listeners
+    // compare the same numbers. Equal ranks fall back to the bully id.
+    class bully_election
+    {
+    public:
+        // Brings the successor up to date before anyone is told it leads
+        using handoff_sync = std::function<void(const Client& successor)>;
+
+        explicit bully_election(const election_options& options = {});
+        ~bully_election();
+
+        void start(std::uint16_t my_id);
+        // Local is our own region, upstream the leaders of the other regions
+        void set_peers(const std::vector<Client>& local, const std::vector<Client>& upstream);
+        void handle_message(const Bully& bl, const std::string& sender_ip);
+
+        // 0 when there is no leader yet
+        std::uint16_t leader_id() const;
+        bool is_leader() const;
+        // What to report to the connector
+        std::uint16_t own_rank() const;
+        // Lock free, never waits on the election or on a rebuild. Until the first
+        // election is decided the best ranked member counts as the leader
+        std::shared_ptr<const coordinator_view> view() const;
+
+        // Used when we hand off on our own because we got busy
+        void set_handoff_sync(handoff_sync sync);
+        // Planned transfer to the best ranked peer in our region, false when we don't lead or nobody is there.
+        // Returns once the room has been told, so it is safe to shut down right after.
+        bool hand_off(const handoff_sync& sync);
+        // Where commands meant for the leader should go right after a handoff, empty otherwise
+        std::string handed_off_to() const;
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        enum struct phase {
+            FOLLOWER,
+            ELECTING,
+            WAITING_FOR_VICTORY,
+            LEADER,
+            // Still the leader while the successor is synced, but not announcing it
+            HANDING_OFF,
+        };
+
+        void run(std::stop_token st);
+        bool hand_off(std::unique_lock<std::mutex>& lock, const handoff_sync& sync, std::shared_ptr<std::promise<void>> announced = {});
+        bool stepped_down(clock::time_point now) const;
+
+        // These expect mutex to be held
+        void begin_election(clock::time_point now);
+        void become_leader(clock::time_point now);
+        void follow(std::uint16_t id, clock::time_point now);
+        bool is_region_leader() const;
+        std::uint16_t my_rank() const;
+        void probe_peers();
+        void update_rank();
+        void rebuild_view();
+        std::vector<std::string> everyone_in(const std::vector<Client>& clients) const;
+        std::vector<std::string> ips_above_us(const std::vector<Client>& clients) const;
+        void send(const std::vector<std::string>& targets, BullyType type, std::uint16_t sender_id, std::uint16_t sender_rank, const std::string& key = "", fanout_done done = {});
+
+        election_options options;
+
+        mutable std::mutex mutex;
+        std::condition_variable_any wake;
+        std::uint16_t my_id = 0;
+        std::vector<Client> local;
+        std::vector<Client> upstream;
+
+        phase state = phase::FOLLOWER;
+        std::uint16_t leader = 0;
+        clock::time_point last_heard_leader{};
+        clock::time_point phase_started{};
+        clock::time_point last_victory_sent{};
+
+        // Views are swapped in RCU style. Readers count themselves in, copy the shared_ptr the
+        // current pointer leads to and count themselves out. Rebuilds keep replaced views in
+        // published and only free them when no reader is in the middle of a copy.
+        std::uint64_t view_epoch = 0;
+        std::list<std::shared_ptr<const coordinator_view>> published{std::make_shared<const coordinator_view>()};
+        std::atomic<const std::shared_ptr<const coordinator_view>*> current_view{&published.back()};
+        mutable std::atomic<std::uint32_t> view_readers{0};
+
+        clock::time_point last_probe{};
+        std::unordered_map<std::string, double> peer_rtt_ms;
+        double scheduling_lag_ms = 0.0;
+        std::uint16_t reported_rank = 0;
+
+        handoff_sync busy_sync;
+        std::string successor_ip;
+        clock::time_point handed_off_at{};
+
+        // Torn down after the thread that sends through it, before the state its callbacks touch
+        fanout fan;
+        std::jthread thread;
+    };
+}
@@ -0,0 +1,70 @@
+#include "failure_detector.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace hnoker
+{
+    phi_accrual_detector::phi_accrual_detector(std::chrono::milliseconds first_heartbeat_estimate, std::chrono::milliseconds min_std_deviation, std::chrono::milliseconds acceptable_pause, std::size_t window_size, clock::time_point now) :
+        min_std_deviation_ms(static_cast<double>(min_std_deviation.count())),
+        acceptable_pause_ms(static_cast<double>(acceptable_pause.count())),
+        window_size(std::max<std::size_t>(window_size, 2)),
+        last_heartbeat(now)
+    {
+        // Seed with a guess so a fresh client isn't evicted before it has any history
+        const double estimate = static_cast<double>(first_heartbeat_estimate.count());
+        add_interval(estimate - estimate / 4.0);
+        add_interval(estimate + estimate / 4.0);
+    }
+
+    void phi_accrual_detector::heartbeat(clock::time_point now)
+    {
+        const double interval = std::chrono::duration<double, std::milli>(now - last_heartbeat).count();
+        last_heartbeat = now;
+        add_interval(interval);
+    }
+
+    double phi_accrual_detector::phi(clock::time_point now) const
+    {
+        const double since_last = std::chrono::duration<double, std::milli>(now - last_heartbeat).count();
+        const double mean = mean_interval_ms() + acceptable_pause_ms;
+        const double std_dev = std_deviation_ms();
+
+        // Logistic approximation of the normal CDF, accurate enough and cheap
+        const double y = (since_last - mean) / std_dev;
+        const double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+        const double p_later = since_last > mean ? e / (1.0 + e) : 1.0 - 1.0 / (1.0 + e);
+
+        if (p_later <= 0.0)
+            return std::numeric_limits<double>::max();
+        return -std::log10(p_later);
+    }
+
+    double phi_accrual_detector::mean_interval_ms() const
+    {
+        return interval_sum / static_cast<double>(intervals.size());
+    }
+
+    double phi_accrual_detector::std_deviation_ms() const
+    {
+        const double mean = mean_interval_ms();
+        const double variance = interval_sum_sq / static_cast<double>(intervals.size()) - mean * mean;
+        return std::max(std::sqrt(std::max(variance, 0.0)), min_std_deviation_ms);
+    }
+
+    void phi_accrual_detector::add_interval(double interval_ms)
+    {
+        intervals.push_back(interval_ms);
+        interval_sum += interval_ms;
+        interval_sum_sq += interval_ms * interval_ms;
+
+        if (intervals.size() > window_size)
+        {
+            const double oldest = intervals.front();
+            intervals.pop_front();
+            interval_sum -= oldest;
+            interval_sum_sq -= oldest * oldest;
+        }
+    }
+}
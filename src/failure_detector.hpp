@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+
+namespace hnoker
+{
+    // Phi accrual failure detector (Hayashibara et al.). Instead of a yes/no
+    // timeout it keeps a window of heartbeat inter-arrival times and reports how
+    // unlikely the current silence is, phi = -log10(P(silence this long)). A phi
+    // of 8 means roughly a 1 in 10^8 chance that a live node would be this late.
+    class phi_accrual_detector
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        explicit phi_accrual_detector(
+            std::chrono::milliseconds first_heartbeat_estimate = std::chrono::milliseconds(1000),
+            std::chrono::milliseconds min_std_deviation = std::chrono::milliseconds(100),
+            std::chrono::milliseconds acceptable_pause = std::chrono::milliseconds(0),
+            std::size_t window_size = 100,
+            clock::time_point now = clock::now());
+
+        void heartbeat(clock::time_point now);
+        // Counts silence from now on without recording an interval, for nodes we lost track of
+        void restart(clock::time_point now) { last_heartbeat = now; }
+        double phi(clock::time_point now) const;
+
+        bool is_available(clock::time_point now, double threshold) const
+        {
+            return phi(now) < threshold;
+        }
+
+        double mean_interval_ms() const;
+        double std_deviation_ms() const;
+
+    private:
+        void add_interval(double interval_ms);
+
+        std::deque<double> intervals;
+        double interval_sum = 0.0;
+        double interval_sum_sq = 0.0;
+        double min_std_deviation_ms;
+        double acceptable_pause_ms;
+        std::size_t window_size;
+        clock::time_point last_heartbeat;
+    };
+}
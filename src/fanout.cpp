@@ -0,0 +1,88 @@
+#include "fanout.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+
+namespace hnoker
+{
+    using std::chrono::steady_clock;
+
+    fanout::fanout(const fanout_options& options) :
+        options(options)
+    {
+        io_thread = std::jthread{[this]() { net.run_until_stopped(); }};
+    }
+
+    fanout::~fanout()
+    {
+        net.stop();
+    }
+
+    void fanout::send(const std::vector<std::string>& targets, std::uint16_t port, const Message& msg, const std::string& key, fanout_done done)
+    {
+        auto j = std::make_shared<job>();
+        j->key = key;
+        j->frame = make_frame(msg);
+        j->port = port;
+        j->remaining = targets.size();
+        j->done = std::move(done);
+
+        net.post([this, j, targets]() mutable { enqueue(std::move(j), std::move(targets)); });
+    }
+
+    void fanout::enqueue(std::shared_ptr<job> j, std::vector<std::string> targets)
+    {
+        if (!j->key.empty())
+        {
+            // Anything not yet on the wire for the same key is stale now
+            for (auto it = pending.begin(); it != pending.end();)
+            {
+                if (it->owner->key == j->key)
+                {
+                    auto owner = it->owner;
+                    std::string ip = std::move(it->ip);
+                    it = pending.erase(it);
+                    finish(owner, {std::move(ip), false, std::chrono::milliseconds(0)});
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        if (targets.empty() && j->done)
+            j->done({});
+
+        for (std::string& ip : targets)
+            pending.push_back({std::move(ip), j});
+
+        pump();
+    }
+
+    void fanout::pump()
+    {
+        while (in_flight < options.max_in_flight && !pending.empty())
+        {
+            pending_send next = std::move(pending.front());
+            pending.pop_front();
+            in_flight++;
+
+            const auto started = steady_clock::now();
+            net.async_send_frame(next.ip, next.owner->port, next.owner->frame, options.deadline, [this, next, started](bool delivered)
+            {
+                in_flight--;
+                auto took = std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - started);
+                finish(next.owner, {next.ip, delivered, took});
+                pump();
+            });
+        }
+    }
+
+    void fanout::finish(const std::shared_ptr<job>& j, fanout_result result)
+    {
+        j->results.push_back(std::move(result));
+        if (--j->remaining == 0 && j->done)
+            j->done(j->results);
+    }
+}
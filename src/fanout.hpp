@@ -0,0 +1,77 @@
+#pragma once
+
+#include "message_types.hpp"
+#include "networking.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hnoker
+{
+    struct fanout_options
+    {
+        std::size_t max_in_flight = 32;
+        std::chrono::milliseconds deadline{1000};
+    };
+
+    struct fanout_result
+    {
+        std::string ip;
+        bool delivered;
+        std::chrono::milliseconds took;
+    };
+
+    using fanout_done = std::function<void(const std::vector<fanout_result>& results)>;
+
+    // Background stage that delivers one message to many targets. Callers only
+    // enqueue and return, the sends run on the stage's own io thread with a
+    // bounded number in flight and a deadline per target.
+    class fanout
+    {
+    public:
+        explicit fanout(const fanout_options& options = {});
+        ~fanout();
+
+        fanout(const fanout&) = delete;
+        fanout& operator=(const fanout&) = delete;
+
+        // Sends queued under the same non-empty key are superseded by newer ones,
+        // so a burst of membership changes only delivers the latest list
+        void send(const std::vector<std::string>& targets, std::uint16_t port, const Message& msg, const std::string& key = "", fanout_done done = {});
+
+    private:
+        struct job
+        {
+            std::string key;
+            frame_ptr frame;
+            std::uint16_t port;
+            std::size_t remaining;
+            std::vector<fanout_result> results;
+            fanout_done done;
+        };
+
+        struct pending_send
+        {
+            std::string ip;
+            std::shared_ptr<job> owner;
+        };
+
+        // These only run on the io thread
+        void enqueue(std::shared_ptr<job> j, std::vector<std::string> targets);
+        void pump();
+        void finish(const std::shared_ptr<job>& j, fanout_result result);
+
+        fanout_options options;
+        network net;
+        std::deque<pending_send> pending;
+        std::size_t in_flight = 0;
+        std::jthread io_thread;
+    };
+}
@@ -0,0 +1,458 @@
+#include "gossip.hpp"
+#include "logging.hpp"
+#include "networking.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <span>
+
+namespace hnoker
+{
+    using std::chrono::steady_clock;
+
+    gossip_membership::gossip_membership(const gossip_options& options, std::function<endpoint()> connector) :
+        options(options),
+        connector(std::move(connector))
+    {
+        io_thread = std::jthread{[this]() { net.run_until_stopped(); }};
+    }
+
+    gossip_membership::~gossip_membership()
+    {
+        protocol_thread.request_stop();
+        relay_thread.request_stop();
+        relay_cv.notify_all();
+        // Both send through net, so they are done before it stops
+        if (protocol_thread.joinable())
+            protocol_thread.join();
+        if (relay_thread.joinable())
+            relay_thread.join();
+        net.stop();
+    }
+
+    void gossip_membership::send_message(const std::string& ip, std::uint16_t port, const Message& msg)
+    {
+        net.async_send_frame(ip, port, make_frame(msg), options.ack_timeout, [ip](bool delivered)
+        {
+            if (!delivered)
+                INFO("Timed out while sending GOSSIP to {}", ip);
+        });
+    }
+
+    void gossip_membership::start(std::uint16_t my_bully_id, const membership_callback& callback)
+    {
+        std::vector<Client> early;
+        {
+            std::lock_guard<std::mutex> lock(members_mutex);
+            my_id = my_bully_id;
+            on_change = callback;
+            early = std::move(early_clients);
+            changed = true;
+        }
+        // The client list may have arrived before our id did
+        merge(early);
+
+        INFO("Starting gossip membership, bully_id: {}", my_bully_id);
+        protocol_thread = std::jthread{[this](std::stop_token st) { protocol_loop(st); }};
+        relay_thread = std::jthread{[this](std::stop_token st) { relay_loop(st); }};
+    }
+
+    void gossip_membership::merge(const std::vector<Client>& clients)
+    {
+        {
+            std::lock_guard<std::mutex> lock(members_mutex);
+            // Without an id we can't tell ourselves apart from everyone else
+            if (my_id == 0)
+            {
+                early_clients = clients;
+                return;
+            }
+            for (const Client& c : clients)
+            {
+                if (c.bully_id == my_id)
+                {
+                    if (my_ip.empty())
+                    {
+                        my_ip = c.ip;
+                        member self{c, MemberState::ALIVE, my_incarnation};
+                        table[c.ip] = self;
+                        enqueue_update(self);
+                        changed = true;
+                    }
+                    continue;
+                }
+
+                // The connector only knows about joins, gossip is authoritative for everything else
+                if (table.contains(c.ip) || tombstones.contains(c.ip))
+                    continue;
+
+                member m{c, MemberState::ALIVE, 0};
+                table[c.ip] = m;
+                enqueue_update(m);
+                changed = true;
+            }
+        }
+        notify_change();
+    }
+
+    void gossip_membership::handle_message(const Gossip& gs, const std::string& sender_ip)
+    {
+        {
+            std::lock_guard<std::mutex> lock(members_mutex);
+            for (const MemberUpdate& u : gs.updates)
+                apply_update(u);
+
+            // Hearing from a member directly is better evidence than any rumour about it
+            auto it = table.find(sender_ip);
+            if (it != table.end() && it->second.state == MemberState::SUSPECT)
+            {
+                it->second.state = MemberState::ALIVE;
+                changed = true;
+            }
+        }
+        notify_change();
+
+        switch (gs.gt)
+        {
+            case GossipType::PING:
+                send(sender_ip, GossipType::ACK, gs.seq, gs.target);
+                break;
+            case GossipType::PING_REQ:
+            {
+                std::lock_guard<std::mutex> lock(relay_mutex);
+                relay_jobs.push_back({sender_ip, gs.seq, gs.target});
+                relay_cv.notify_one();
+                break;
+            }
+            case GossipType::ACK:
+            {
+                std::lock_guard<std::mutex> lock(ack_mutex);
+                acked.push_back(gs.seq);
+                if (acked.size() > 64)
+                    acked.erase(acked.begin());
+                ack_cv.notify_all();
+                break;
+            }
+            case GossipType::REPORT:
+                // Meant for the connector, the updates above are all there is to it
+                break;
+        }
+    }
+
+    std::vector<Client> gossip_membership::members()
+    {
+        std::lock_guard<std::mutex> lock(members_mutex);
+        return members_locked();
+    }
+
+    void gossip_membership::protocol_loop(std::stop_token st)
+    {
+        // Waits out the rest of each period, but wakes as soon as we are shutting down
+        std::mutex sleep_mutex;
+        std::condition_variable_any sleeper;
+        while (!st.stop_requested())
+        {
+            const auto period_start = steady_clock::now();
+
+            Client target;
+            bool has_target = false;
+            std::vector<Client> dead;
+            {
+                std::lock_guard<std::mutex> lock(members_mutex);
+                dead = expire_suspects();
+
+                // Round-robin over a shuffled order bounds the time to first detection
+                if (probe_index >= probe_order.size())
+                {
+                    probe_order.clear();
+                    for (auto& [ip, m] : table)
+                    {
+                        if (ip != my_ip)
+                            probe_order.push_back(ip);
+                    }
+                    std::shuffle(probe_order.begin(), probe_order.end(), gen);
+                    probe_index = 0;
+                }
+
+                while (probe_index < probe_order.size() && !has_target)
+                {
+                    auto it = table.find(probe_order[probe_index++]);
+                    if (it != table.end())
+                    {
+                        target = it->second.client;
+                        has_target = true;
+                    }
+                }
+            }
+
+            if (!dead.empty())
+            {
+                notify_change();
+                INFO("Gossip confirmed {} failed members, reporting to connector", dead.size());
+                Message report{ MessageType::GOSSIP };
+                report.gs.gt = GossipType::REPORT;
+                report.gs.seq = 0;
+                for (const Client& c : dead)
+                    report.gs.updates.push_back({c, MemberState::DEAD, 0});
+                const endpoint c = connector();
+                send_message(c.ip, c.port, report);
+            }
+
+            if (has_target && !probe(target, next_seq()))
+            {
+                std::lock_guard<std::mutex> lock(members_mutex);
+                auto it = table.find(target.ip);
+                if (it != table.end() && it->second.state == MemberState::ALIVE)
+                {
+                    INFO("Gossip suspects {} after failed direct and indirect probes", target.ip);
+                    it->second.state = MemberState::SUSPECT;
+                    it->second.suspect_since = steady_clock::now();
+                    enqueue_update(it->second);
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeper.wait_until(lock, st, period_start + options.protocol_period, []() { return false; });
+        }
+    }
+
+    void gossip_membership::relay_loop(std::stop_token st)
+    {
+        while (!st.stop_requested())
+        {
+            relay_job job;
+            {
+                std::unique_lock<std::mutex> lock(relay_mutex);
+                if (!relay_cv.wait(lock, st, [this]() { return !relay_jobs.empty(); }))
+                    return;
+                job = std::move(relay_jobs.front());
+                relay_jobs.pop_front();
+            }
+
+            const std::uint32_t seq = next_seq();
+            send(job.target.ip, GossipType::PING, seq, job.target);
+            if (wait_for_ack(seq, steady_clock::now() + options.ack_timeout))
+                send(job.requester_ip, GossipType::ACK, job.requester_seq, job.target);
+        }
+    }
+
+    bool gossip_membership::probe(const Client& target, std::uint32_t seq)
+    {
+        const auto period_end = steady_clock::now() + options.protocol_period;
+
+        send(target.ip, GossipType::PING, seq, target);
+        if (wait_for_ack(seq, steady_clock::now() + options.ack_timeout))
+            return true;
+
+        std::vector<Client> helpers;
+        {
+            std::lock_guard<std::mutex> lock(members_mutex);
+            helpers = pick_random_members(options.indirect_probes, target.ip);
+        }
+
+        INFO("No ack from {}, asking {} members to probe it", target.ip, helpers.size());
+        for (const Client& h : helpers)
+            send(h.ip, GossipType::PING_REQ, seq, target);
+
+        return wait_for_ack(seq, period_end);
+    }
+
+    bool gossip_membership::wait_for_ack(std::uint32_t seq, steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(ack_mutex);
+        return ack_cv.wait_until(lock, deadline, [&]()
+        {
+            return std::find(acked.begin(), acked.end(), seq) != acked.end();
+        });
+    }
+
+    void gossip_membership::send(const std::string& ip, GossipType gt, std::uint32_t seq, const Client& target)
+    {
+        Message msg{ MessageType::GOSSIP };
+        msg.gs.gt = gt;
+        msg.gs.seq = seq;
+        msg.gs.target = target;
+        msg.gs.updates = take_piggyback();
+        send_message(ip, LISTENER_SERVER_PORT, msg);
+    }
+
+    std::vector<MemberUpdate> gossip_membership::take_piggyback()
+    {
+        std::lock_guard<std::mutex> lock(members_mutex);
+
+        // Freshest news first, it has the most transmissions left
+        std::stable_sort(piggyback.begin(), piggyback.end(), [](const pending_update& a, const pending_update& b)
+        {
+            return a.transmissions_left > b.transmissions_left;
+        });
+
+        std::vector<MemberUpdate> out;
+        for (auto& p : piggyback)
+        {
+            if (out.size() >= options.max_piggyback)
+                break;
+            out.push_back(p.update);
+            p.transmissions_left--;
+        }
+
+        std::erase_if(piggyback, [](const pending_update& p) { return p.transmissions_left == 0; });
+        return out;
+    }
+
+    void gossip_membership::apply_update(const MemberUpdate& u)
+    {
+        const std::string& ip = u.client.ip;
+
+        if (ip == my_ip || u.client.bully_id == my_id)
+        {
+            // Refute rumours about ourselves by outliving them
+            if (u.state != MemberState::ALIVE && u.incarnation >= my_incarnation)
+            {
+                my_incarnation = u.incarnation + 1;
+                INFO("Refuting suspicion about this node, incarnation now {}", my_incarnation);
+                auto it = table.find(my_ip);
+                if (it != table.end())
+                {
+                    it->second.incarnation = my_incarnation;
+                    enqueue_update(it->second);
+                }
+            }
+            return;
+        }
+
+        auto tomb = tombstones.find(ip);
+        if (tomb != tombstones.end())
+        {
+            if (u.state == MemberState::DEAD || u.incarnation <= tomb->second)
+                return;
+            tombstones.erase(tomb);
+        }
+
+        auto it = table.find(ip);
+        if (it == table.end())
+        {
+            if (u.state == MemberState::DEAD)
+            {
+                tombstones[ip] = u.incarnation;
+                return;
+            }
+
+            member m{u.client, u.state, u.incarnation, steady_clock::now()};
+            table[ip] = m;
+            enqueue_update(m);
+            changed = true;
+            return;
+        }
+
+        member& m = it->second;
+        switch (u.state)
+        {
+            case MemberState::ALIVE:
+                if (u.incarnation > m.incarnation)
+                {
+                    changed |= m.state != MemberState::ALIVE;
+                    m.state = MemberState::ALIVE;
+                    m.incarnation = u.incarnation;
+                    enqueue_update(m);
+                }
+                break;
+            case MemberState::SUSPECT:
+                if ((m.state == MemberState::ALIVE && u.incarnation >= m.incarnation) || u.incarnation > m.incarnation)
+                {
+                    if (m.state != MemberState::SUSPECT)
+                        m.suspect_since = steady_clock::now();
+                    m.state = MemberState::SUSPECT;
+                    m.incarnation = u.incarnation;
+                    enqueue_update(m);
+                }
+                break;
+            case MemberState::DEAD:
+                INFO("Gossip reports {} as failed", ip);
+                tombstones[ip] = std::max(u.incarnation, m.incarnation);
+                m.state = MemberState::DEAD;
+                enqueue_update(m);
+                table.erase(it);
+                changed = true;
+                break;
+        }
+    }
+
+    void gossip_membership::enqueue_update(const member& m)
+    {
+        std::erase_if(piggyback, [&](const pending_update& p) { return p.update.client.ip == m.client.ip; });
+
+        const double n = static_cast<double>(table.size()) + 1.0;
+        const auto transmissions = static_cast<unsigned int>(options.retransmit_mult * std::ceil(std::log2(n + 1.0)));
+        piggyback.push_back({{m.client, m.state, m.incarnation}, std::max(transmissions, 1u)});
+    }
+
+    std::vector<Client> gossip_membership::expire_suspects()
+    {
+        std::vector<Client> dead;
+        const auto now = steady_clock::now();
+        for (auto it = table.begin(); it != table.end();)
+        {
+            member& m = it->second;
+            if (m.state == MemberState::SUSPECT && now - m.suspect_since > options.protocol_period * options.suspicion_periods)
+            {
+                INFO("Suspicion about {} timed out, declaring it failed", it->first);
+                tombstones[it->first] = m.incarnation;
+                m.state = MemberState::DEAD;
+                enqueue_update(m);
+                dead.push_back(m.client);
+                it = table.erase(it);
+                changed = true;
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        return dead;
+    }
+
+    std::vector<Client> gossip_membership::members_locked() const
+    {
+        std::vector<Client> out;
+        for (auto& [ip, m] : table)
+            out.push_back(m.client);
+        return out;
+    }
+
+    std::vector<Client> gossip_membership::pick_random_members(std::size_t k, const std::string& exclude_ip)
+    {
+        std::vector<Client> candidates;
+        for (auto& [ip, m] : table)
+        {
+            if (ip != exclude_ip && ip != my_ip && m.state == MemberState::ALIVE)
+                candidates.push_back(m.client);
+        }
+
+        std::shuffle(candidates.begin(), candidates.end(), gen);
+        if (candidates.size() > k)
+            candidates.resize(k);
+        return candidates;
+    }
+
+    std::uint32_t gossip_membership::next_seq()
+    {
+        std::lock_guard<std::mutex> lock(members_mutex);
+        return ++seq_counter;
+    }
+
+    void gossip_membership::notify_change()
+    {
+        membership_callback callback;
+        std::vector<Client> current;
+        {
+            std::lock_guard<std::mutex> lock(members_mutex);
+            if (!changed || !on_change)
+                return;
+            changed = false;
+            callback = on_change;
+            current = members_locked();
+        }
+        callback(current);
+    }
+}
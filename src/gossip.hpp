@@ -0,0 +1,120 @@
+#pragma once
+
+#include "message_types.hpp"
+#include "networking.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace hnoker
+{
+    using membership_callback = std::function<void(const std::vector<Client>& members)>;
+
+    struct gossip_options
+    {
+        std::chrono::milliseconds protocol_period{1000};
+        std::chrono::milliseconds ack_timeout{300};
+        unsigned int indirect_probes = 3;
+        unsigned int suspicion_periods = 3;
+        unsigned int max_piggyback = 6;
+        unsigned int retransmit_mult = 3;
+    };
+
+    // SWIM style membership: every protocol period one random member is probed
+    // directly, then indirectly through k others, and membership changes ride
+    // along on the probes instead of being broadcast. Cost per node per period
+    // stays constant no matter how many members there are.
+    class gossip_membership
+    {
+    public:
+        gossip_membership(const gossip_options& options, std::function<endpoint()> connector);
+        ~gossip_membership();
+
+        void start(std::uint16_t my_bully_id, const membership_callback& on_change);
+        void merge(const std::vector<Client>& clients);
+        void handle_message(const Gossip& gs, const std::string& sender_ip);
+        std::vector<Client> members();
+
+    private:
+        struct member
+        {
+            Client client;
+            MemberState state = MemberState::ALIVE;
+            std::uint32_t incarnation = 0;
+            std::chrono::steady_clock::time_point suspect_since{};
+        };
+
+        struct pending_update
+        {
+            MemberUpdate update;
+            unsigned int transmissions_left;
+        };
+
+        struct relay_job
+        {
+            std::string requester_ip;
+            std::uint32_t requester_seq;
+            Client target;
+        };
+
+        void protocol_loop(std::stop_token st);
+        void relay_loop(std::stop_token st);
+        bool probe(const Client& target, std::uint32_t seq);
+        bool wait_for_ack(std::uint32_t seq, std::chrono::steady_clock::time_point deadline);
+        void send(const std::string& ip, GossipType gt, std::uint32_t seq, const Client& target);
+        // Queued on our own io thread, so nobody waits for the connection
+        void send_message(const std::string& ip, std::uint16_t port, const Message& msg);
+        std::vector<MemberUpdate> take_piggyback();
+        std::uint32_t next_seq();
+        void notify_change();
+
+        // These expect members_mutex to be held
+        void apply_update(const MemberUpdate& u);
+        void enqueue_update(const member& m);
+        std::vector<Client> expire_suspects();
+        std::vector<Client> members_locked() const;
+        std::vector<Client> pick_random_members(std::size_t k, const std::string& exclude_ip);
+
+        gossip_options options;
+        std::function<endpoint()> connector;
+
+        std::mutex members_mutex;
+        std::uint16_t my_id = 0;
+        std::string my_ip;
+        std::uint32_t my_incarnation = 0;
+        std::unordered_map<std::string, member> table;
+        std::unordered_map<std::string, std::uint32_t> tombstones;
+        std::deque<pending_update> piggyback;
+        std::vector<std::string> probe_order;
+        std::size_t probe_index = 0;
+        std::uint32_t seq_counter = 0;
+        std::mt19937 gen{std::random_device{}()};
+        membership_callback on_change;
+        bool changed = false;
+        // What the connector sent before we had an id, merged once we know which one is us
+        std::vector<Client> early_clients;
+
+        std::mutex ack_mutex;
+        std::condition_variable ack_cv;
+        std::vector<std::uint32_t> acked;
+
+        std::mutex relay_mutex;
+        std::condition_variable_any relay_cv;
+        std::deque<relay_job> relay_jobs;
+
+        network net;
+        std::jthread io_thread;
+        std::jthread protocol_thread;
+        std::jthread relay_thread;
+    };
+}
@@ -0,0 +1,48 @@
+#include "hlc.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+
+namespace hnoker
+{
+    hlc_timestamp hybrid_clock::wall()
+    {
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        return static_cast<hlc_timestamp>(ms) << 16;
+    }
+
+    // A counter that runs over carries into the milliseconds, which is still in order
+    hlc_timestamp hybrid_clock::now()
+    {
+        const hlc_timestamp w = wall();
+        std::lock_guard<std::mutex> lock(mutex);
+        latest = std::max(latest + 1, w);
+        return latest;
+    }
+
+    hlc_timestamp hybrid_clock::observe(hlc_timestamp remote)
+    {
+        const hlc_timestamp w = wall();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (hlc_physical_ms(remote) > hlc_physical_ms(w) + max_ahead.count())
+        {
+            WARN("Ignoring a timestamp {} ms ahead of our clock", hlc_physical_ms(remote) - hlc_physical_ms(w));
+            latest = std::max(latest + 1, w);
+            return latest;
+        }
+        latest = std::max({latest + 1, remote + 1, w});
+        return latest;
+    }
+
+    hlc_timestamp hybrid_clock::last() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return latest;
+    }
+
+    hybrid_clock& process_clock()
+    {
+        static hybrid_clock clock;
+        return clock;
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace hnoker
+{
+    // Hybrid logical clock timestamp: wall clock milliseconds in the top 48 bits
+    // and a counter for events within the same millisecond in the bottom 16. It
+    // stays close to real time but goes up with every event, and compares as a
+    // plain integer. If a happened before b then a < b. The other way round it
+    // only says which one wins, not that one saw the other.
+    using hlc_timestamp = std::uint64_t;
+
+    constexpr std::uint64_t hlc_physical_ms(hlc_timestamp t) { return t >> 16; }
+    constexpr std::uint16_t hlc_logical(hlc_timestamp t) { return static_cast<std::uint16_t>(t); }
+
+    class hybrid_clock
+    {
+    public:
+        // A peer with a broken clock would drag everyone along, stamps further ahead than this are not taken on
+        static constexpr std::chrono::milliseconds max_ahead{60000};
+
+        // A local event or a send
+        hlc_timestamp now();
+        // A receive, we end up past both the remote stamp and our own
+        hlc_timestamp observe(hlc_timestamp remote);
+        hlc_timestamp last() const;
+
+    private:
+        static hlc_timestamp wall();
+
+        mutable std::mutex mutex;
+        hlc_timestamp latest = 0;
+    };
+
+    // What the networking layer stamps and reads every message with
+    hybrid_clock& process_clock();
+}
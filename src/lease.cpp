@@ -0,0 +1,174 @@
+#include "lease.hpp"
+#include "logging.hpp"
+
+namespace hnoker
+{
+    lease_grantor::lease_grantor(const lease_options& options) :
+        options(options)
+    {}
+
+    lease_grantor::answer lease_grantor::request(const Client& client, clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        answer a{};
+        a.lease.duration_ms = static_cast<std::uint32_t>(options.duration.count());
+        a.lease.granted = false;
+        a.changed = false;
+
+        const bool free = !holder || now >= expires;
+        if (now < not_before)
+        {
+            // Still waiting out whoever might hold it from before we took over
+        }
+        else if (holder && holder->ip == client.ip)
+        {
+            expires = now + options.duration;
+            a.lease.granted = true;
+        }
+        else if (free)
+        {
+            INFO("Lease {} goes to {} ({})", epoch + 1, client.bully_id, client.ip);
+            holder = client;
+            epoch++;
+            expires = now + options.duration;
+            a.lease.granted = true;
+            a.changed = true;
+        }
+
+        a.lease.epoch = epoch;
+        a.lease.holder = holder.value_or(Client{"", 0, 0});
+        return a;
+    }
+
+    lease_grantor::answer lease_grantor::hand_over(const Client& from, const Client& to, clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        answer a{};
+        a.lease.duration_ms = static_cast<std::uint32_t>(options.duration.count());
+        a.lease.granted = false;
+        a.changed = false;
+
+        // Only a lease that is still good can be handed on, otherwise the successor asks like anyone
+        if (holder && holder->ip == from.ip && now < expires)
+        {
+            INFO("Lease {} goes from {} to {} ({}) with the leadership", epoch + 1, from.bully_id, to.bully_id, to.ip);
+            holder = to;
+            epoch++;
+            expires = now + options.duration;
+            a.lease.granted = true;
+            a.changed = true;
+        }
+
+        a.lease.epoch = epoch;
+        a.lease.holder = holder.value_or(Client{"", 0, 0});
+        return a;
+    }
+
+    void lease_grantor::promoted(clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        holder.reset();
+        not_before = now + options.duration;
+    }
+
+    leader_lease::leader_lease(const lease_options& options, bool enabled) :
+        options(options),
+        enabled(enabled)
+    {}
+
+    void leader_lease::requested(clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Anything older could not give us a lease that is still good anyway
+        while (!open_requests.empty() && now - open_requests.front() > options.duration)
+            open_requests.pop_front();
+        open_requests.push_back(now);
+    }
+
+    void leader_lease::update(const Lease& ls, std::uint16_t my_id, clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // The connector is the authority, a failed over one may well count from a lower epoch
+        if (ls.epoch != known_epoch || ls.holder.ip != holder.ip)
+            INFO("Lease {} is held by {} ({})", ls.epoch, ls.holder.bully_id, ls.holder.ip);
+        known_epoch = ls.epoch;
+        holder = ls.holder;
+        // Once it isn't ours anymore there is nothing left to hand over
+        if (ls.holder.bully_id != my_id)
+            successor_id = 0;
+
+        // An answer still on its way when we handed off doesn't make us lead again
+        if (ls.granted && ls.holder.bully_id == my_id && successor_id == 0)
+        {
+            // Counted from when we asked, not when the answer got here, so we always stop first
+            const clock::time_point asked = open_requests.empty() ? now : open_requests.front();
+            if (!open_requests.empty())
+                open_requests.pop_front();
+            valid_until = asked + std::chrono::milliseconds(ls.duration_ms) - options.margin;
+            ours = true;
+        }
+        else
+        {
+            ours = false;
+            open_requests.clear();
+        }
+    }
+
+    bool leader_lease::may_lead(clock::time_point now)
+    {
+        if (!enabled)
+            return true;
+        std::lock_guard<std::mutex> lock(mutex);
+        return ours && now < valid_until;
+    }
+
+    std::uint32_t leader_lease::epoch()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return known_epoch;
+    }
+
+    bool leader_lease::accepts_relayed(std::uint32_t push_epoch)
+    {
+        if (!enabled)
+            return true;
+        std::lock_guard<std::mutex> lock(mutex);
+        return push_epoch >= known_epoch;
+    }
+
+    void leader_lease::hand_over(std::uint16_t successor)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ours = false;
+        if (enabled && holder.bully_id != successor)
+            successor_id = successor;
+    }
+
+    std::uint16_t leader_lease::handing_to()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return successor_id;
+    }
+
+    std::string leader_lease::other_holder_ip()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ours ? "" : holder.ip;
+    }
+
+    bool leader_lease::accepts_push(const std::string& ip, std::uint32_t push_epoch)
+    {
+        if (!enabled)
+            return true;
+        std::lock_guard<std::mutex> lock(mutex);
+        // Nothing to go by yet
+        if (known_epoch == 0)
+            return true;
+        if (push_epoch != known_epoch)
+            return push_epoch > known_epoch;
+        return ip == holder.ip;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "message_types.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace hnoker
+{
+    struct lease_options
+    {
+        std::chrono::milliseconds duration{2000};
+        // The holder stops leading this long before the connector could give the lease away
+        std::chrono::milliseconds margin{200};
+    };
+
+    // Connector side. One listener at a time holds the lease, it keeps it by
+    // asking again before it runs out and nobody else gets it until it has.
+    class lease_grantor
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        explicit lease_grantor(const lease_options& options = {});
+
+        struct answer
+        {
+            Lease lease;
+            // A new holder or epoch, everyone should hear about it
+            bool changed;
+        };
+        answer request(const Client& client, clock::time_point now);
+        // The holder gives what is left of its lease to the successor it handed leadership to
+        answer hand_over(const Client& from, const Client& to, clock::time_point now);
+        // A standby that takes over doesn't know who held it, so it waits one lease out first
+        void promoted(clock::time_point now);
+
+    private:
+        lease_options options;
+        std::mutex mutex;
+        std::optional<Client> holder;
+        std::uint32_t epoch = 0;
+        clock::time_point expires{};
+        clock::time_point not_before{};
+    };
+
+    // Listener side, what we know about the lease
+    class leader_lease
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // Disabled means there is nobody to ask, then the election alone decides
+        leader_lease(const lease_options& options, bool enabled);
+
+        // Call when a lease request goes out, the answer is measured from the oldest one still open
+        void requested(clock::time_point now);
+        void update(const Lease& ls, std::uint16_t my_id, clock::time_point now);
+
+        // Whether we may push state and relay commands as the leader
+        bool may_lead(clock::time_point now);
+        std::uint32_t epoch();
+        // Empty when nobody holds it or we were the last to
+        std::string other_holder_ip();
+        // Pushes from anyone but the holder of the newest lease we know of are dropped
+        bool accepts_push(const std::string& ip, std::uint32_t push_epoch);
+        // A region leader passes on what the holder sent, only the epoch says anything about it
+        bool accepts_relayed(std::uint32_t push_epoch);
+
+        // We handed leadership off, stop leading and have the connector move the lease
+        // to the successor. 0 once the connector says someone else holds it.
+        void hand_over(std::uint16_t successor_id);
+        std::uint16_t handing_to();
+
+    private:
+        lease_options options;
+        bool enabled;
+
+        std::mutex mutex;
+        std::deque<clock::time_point> open_requests;
+        std::uint32_t known_epoch = 0;
+        Client holder{};
+        bool ours = false;
+        clock::time_point valid_until{};
+        std::uint16_t successor_id = 0;
+    };
+}
@@ -1,3 +1,9 @@
+#include "clock_sync.hpp"
+#include "command_log.hpp"
+#include "election.hpp"
+#include "fanout.hpp"
+#include "gossip.hpp"
+#include "lease.hpp"
 #include "listener.hpp"
 #include "logging.hpp"
 #include "functional"
@@ -5,57 +11,131 @@
 #include "networking.hpp"
 #include "player.hpp"
 
+#include <algorithm>
 #include <functional>
 #include <array>
+#include <atomic>
+#include <csignal>
 #include <string_view>
 #include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <span>
+#include <thread>
 
 namespace hnoker
 {
-    static bool is_this_coordinator(ClientList& cl)
+    // All a signal handler may safely do is set a flag, a thread turns it into a stop
+    static std::atomic<bool> shutdown_signalled{false};
+
+    static void on_shutdown_signal(int)
     {
-        std::uint16_t my_id = cl.bully_id;
-        Client coordinator;
-        coordinator.bully_id = 0;
-        for (auto& c : cl.clients)
-        {
-            if (c.bully_id > coordinator.bully_id)
-                coordinator = c;
-        }
-        return coordinator.bully_id == my_id;
+        shutdown_signalled = true;
     }
-    
-    static void relay_cm_to_all_clients(ControlMusic& cm, ClientList& cl)
-    {
-        network net;
-        Message msg { MessageType::CONTROL_MUSIC };
 
-        std::array<char, 1024> rbuf;
-        std::array<char, 1024> wbuf;
+    // The server, heartbeat and gossip threads all change it while the player and the
+    // schedule sender read it, so nobody gets at the list itself, only at copies
+    class listener_membership
+    {
+    public:
+        ClientList get() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return list;
+        }
 
-        std::function w = [&](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
+        // The election hears about every change, in the order they were made
+        template<class F>
+        void update(F&& change, bully_election& election)
         {
-            write_message_to_buffer(write_buf, msg);
-            return false;
-        };
+            std::lock_guard<std::mutex> lock(mutex);
+            change(list);
+            election.set_peers(list.clients, list.upstream);
+        }
 
-        std::function th = []()
+        // CONNECTOR_LIST_UPDATE parts can come in any order, this gives the whole list once the last one is in
+        std::optional<ClientListUpdate> assemble(const ClientListUpdate& clu)
         {
-            INFO("Failed to relay CONTROL_MUSIC to listener");
-        };
+            std::lock_guard<std::mutex> lock(mutex);
+            if (clu.parts <= 1)
+                return clu;
+            if (clu.part >= clu.parts)
+                return std::nullopt;
+            if (incoming_id != clu.list_id || incoming_parts.size() != clu.parts)
+            {
+                // A newer list, whatever we had of the last one is no use now
+                incoming_id = clu.list_id;
+                incoming_parts.assign(clu.parts, {});
+                incoming_have.assign(clu.parts, false);
+                incoming_count = 0;
+            }
+            if (!incoming_have[clu.part])
+                incoming_count++;
+            incoming_have[clu.part] = true;
+            incoming_parts[clu.part] = clu;
+            if (incoming_count < clu.parts)
+                return std::nullopt;
 
-        for (auto& c : cl.clients)
-        { 
-            if (!is_this_coordinator(cl))
+            ClientListUpdate whole{};
+            for (const auto& part : incoming_parts)
             {
-                net.async_connect_server(c.ip, LISTENER_SERVER_PORT, rbuf, wbuf, w, th);
-                net.run();
+                whole.clients.insert(whole.clients.end(), part.clients.begin(), part.clients.end());
+                whole.upstream.insert(whole.upstream.end(), part.upstream.begin(), part.upstream.end());
             }
+            incoming_parts.clear();
+            incoming_have.clear();
+            incoming_count = 0;
+            return whole;
+        }
+
+    private:
+        mutable std::mutex mutex;
+        ClientList list{};
+
+        std::uint32_t incoming_id = 0;
+        std::vector<ClientListUpdate> incoming_parts;
+        std::vector<bool> incoming_have;
+        std::size_t incoming_count = 0;
+    };
+
+    // All targets at once on the relay's own thread, so the room hears it within one round trip
+    static void relay_to_all_clients(const Message& msg, const std::vector<Client>& targets, std::uint16_t my_id, fanout& relay, const std::string& what)
+    {
+        std::vector<std::string> ips;
+        for (auto& c : targets)
+        {
+            if (c.bully_id != my_id)
+                ips.push_back(c.ip);
         }
+        if (ips.empty())
+            return;
+
+        relay.send(ips, LISTENER_SERVER_PORT, msg, "", [what](const std::vector<fanout_result>& results)
+        {
+            std::chrono::milliseconds slowest{0};
+            std::size_t failed = 0;
+            for (const fanout_result& r : results)
+            {
+                if (!r.delivered)
+                {
+                    INFO("Failed to relay {} to {}", what, r.ip);
+                    failed++;
+                }
+                else
+                {
+                    slowest = std::max(slowest, r.took);
+                }
+            }
+            INFO("Relayed {} to {}/{} listeners, slowest took {} ms", what, results.size() - failed, results.size(), slowest.count());
+        });
     }
 
-    static void send_player_status(std::string_view ip, std::span<char> rbuf, std::span<char> wbuf, player::MusicPlayer& player)
+    static void send_player_status(std::string_view ip, std::span<char> rbuf, std::span<char> wbuf, player::MusicPlayer& player, std::uint32_t lease_epoch)
     {
         INFO("Listener recieved coordinator relay");
         network net;
@@ -64,6 +144,7 @@ namespace hnoker
         {
             Message msg{ MessageType::SEND_STATUS };
             msg.ss = player.get_status();
+            msg.ss.lease_epoch = lease_epoch;
             write_message_to_buffer(wbuf, msg);
             return false;
         };
@@ -78,50 +159,400 @@ namespace hnoker
 
     }
 
-    static bool cm_handler(ControlMusic& cm, player::MusicPlayer& player, ClientList& cl, std::string_view ip, std::span<char> rbuf, std::span<char> wbuf)
+    // Our whole queue, for when the digests differ and no log can say what is missing
+    static void send_queue_snapshot(const std::string& ip, player::MusicPlayer& player, fanout& relay, bool ask_back)
     {
-        INFO("Listener recieved CONTROL_MUSIC");
-        SendStatus status = player.get_status();
-        switch (cm.op)
-        {
-            case ControlOperation::START:
-                if (status.paused)
-                    player.toggle_pause();
-                break;
-            case ControlOperation::STOP:
-                if (!status.paused)
-                    player.toggle_pause();
-                break;
-            case ControlOperation::SKIP:
-                player.skip();
-                break;
+        constexpr std::size_t per_chunk = 20;
+        const auto pieces = player.queue_snapshot(per_chunk);
+        INFO("Sending our queue to {} in {} pieces", ip, pieces.size());
+        for (std::size_t i = 0; i < pieces.size(); i++)
+        {
+            Message msg{ MessageType::QUEUE_DELTA };
+            msg.qd = pieces[i];
+            msg.qd.ask_back = ask_back;
+            // A newer snapshot replaces one still waiting to go
+            relay.send({ip}, LISTENER_SERVER_PORT, msg, std::format("snapshot {} {}", ip, i));
         }
+    }
 
-        if (is_this_coordinator(cl))
-            relay_cm_to_all_clients(cm, cl);
-        else
-            send_player_status(ip, rbuf, wbuf, player);
+    // Only our digest goes out, something only comes back when it differs from theirs:
+    // the queue items we missed if their log still has them, otherwise the timing
+    // while their whole queue follows as a snapshot
+    // The answer is handled on the background network's thread, the caller doesn't wait for it
+    static void sync_state_with(const std::string& ip, player::MusicPlayer& player, leader_lease& lease, const clock_sync& clock, fanout& relay, network& background)
+    {
+        auto rb = std::make_shared<std::array<char, 1024>>();
+        const std::uint32_t epoch = lease.epoch();
+
+        const request_builder request = [&player, epoch]()
+        {
+            Message msg{ MessageType::STATE_DIGEST };
+            msg.sd = player.digest();
+            msg.sd.lease_epoch = epoch;
+            return make_frame(msg);
+        };
 
+        background.async_request(ip, LISTENER_SERVER_PORT, request, *rb, std::chrono::milliseconds(500), [rb, ip, &player, &clock, &relay](bool answered)
+        {
+            if (!answered)
+                return;
+            try
+            {
+                Message reply = read_message_from_buffer(*rb);
+                if (reply.type == MessageType::STATE_DELTA)
+                {
+                    if (player.apply_changes(reply.dl))
+                    {
+                        INFO("Caught up from state {} to {} with {} queue items from {}", reply.dl.from_epoch, reply.dl.state_epoch, reply.dl.items.size(), ip);
+                    }
+                    else
+                    {
+                        // Only a merge of both queues fixes that, they send theirs back if it is still needed
+                        INFO("Our queue has songs {} doesn't", ip);
+                        send_queue_snapshot(ip, player, relay, true);
+                    }
+                    return;
+                }
+                if (reply.type != MessageType::PLAYBACK_SCHEDULE)
+                    return;
+
+                INFO("State differs from {}, taking their timing", ip);
+                if (clock.synced())
+                {
+                    player.follow_schedule(reply.ps, clock.room_now_us());
+                }
+                else
+                {
+                    // Their timebase means nothing to us yet, go by the position alone
+                    const std::int64_t now_us = clock_sync::local_us();
+                    reply.ps.song_started_us = now_us - std::int64_t{reply.ps.position_ms} * 1000;
+                    player.follow_schedule(reply.ps, now_us);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                // Thrown here it would stop the background thread, a garbled answer is just a missed one
+                INFO("Couldn't read the state answer from {}: {}", ip, e.what());
+            }
+        });
+    }
+
+    static std::chrono::steady_clock::time_point local_time_of(std::int64_t room_us, const clock_sync& clock)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (room_us == 0 || !clock.synced())
+            return now;
+        return std::chrono::steady_clock::time_point(std::chrono::microseconds(clock.to_local(room_us)));
+    }
+
+    // Asks whoever sent us entries for what comes after from_index, done gets the answer on the background network's thread
+    static void fetch_log(const std::string& ip, std::uint32_t term, std::uint64_t from_index, network& background, std::function<void(std::optional<AppendEntries>)> done)
+    {
+        auto rb = std::make_shared<std::array<char, 1024>>();
+
+        const request_builder request = [term, from_index]()
+        {
+            Message msg{ MessageType::LOG_FETCH };
+            msg.lf.term = term;
+            msg.lf.from_index = from_index;
+            return make_frame(msg);
+        };
+
+        background.async_request(ip, LISTENER_SERVER_PORT, request, *rb, std::chrono::milliseconds(500), [rb, done = std::move(done)](bool answered)
+        {
+            std::optional<AppendEntries> ae;
+            try
+            {
+                if (answered)
+                {
+                    Message reply = read_message_from_buffer(*rb);
+                    if (reply.type == MessageType::APPEND_ENTRIES)
+                        ae = std::move(reply.ae);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                // A garbled answer counts as no answer, done still has to hear about it
+                INFO("Couldn't read the log fetch answer: {}", e.what());
+            }
+            done(std::move(ae));
+        });
+    }
+
+    // One fetch chain at a time, entries that arrive meanwhile are applied but don't start another
+    static std::atomic<bool> catching_up{false};
+
+    // Applies what came in. When something is missing the fetch goes out on the background network
+    // and its answer comes back through here, until we are caught up or out of fetches.
+    static void follow_log(const AppendEntries& ae, bool fetched, int fetches_left, player::MusicPlayer& player, leader_lease& lease, const clock_sync& clock, fanout& relay, command_log& commands, const std::string& ip, network& background)
+    {
+        const command_log::received r = commands.receive(ae);
+        for (const LogEntry& e : r.to_apply)
+            player.schedule(e, local_time_of(e.execute_at_us, clock));
+
+        if (r.result == command_log::outcome::reset)
+        {
+            if (fetched)
+                catching_up = false;
+            sync_state_with(ip, player, lease, clock, relay, background);
+            return;
+        }
+        // A fetch that still brought something might not have brought everything
+        const bool more = r.result == command_log::outcome::gap || (fetched && !ae.entries.empty());
+        if (!more || fetches_left == 0)
+        {
+            if (fetched)
+                catching_up = false;
+            return;
+        }
+        if (!fetched && catching_up.exchange(true))
+            return;
+
+        fetch_log(ip, ae.term, commands.last_index(), background, [fetches_left, &player, &lease, &clock, &relay, &commands, ip, &background](std::optional<AppendEntries> next)
+        {
+            if (!next)
+            {
+                INFO("Couldn't fetch the command log from {}", ip);
+                catching_up = false;
+                return;
+            }
+            follow_log(*next, true, fetches_left - 1, player, lease, clock, relay, commands, ip, background);
+        });
+    }
+
+    // Only the lease holder puts commands in the log, everyone else sends them its way
+    static void submit(const Message& msg, const LogEntry& entry, player::MusicPlayer& player, const ClientList& cl, const bully_election& election, leader_lease& lease, fanout& relay, const clock_sync& clock, command_log& commands, const listener_options& options, std::string_view ip)
+    {
+        const auto view = election.view();
+
+        // We just handed leadership off, this was sent before the sender heard
+        std::string leader = election.handed_off_to();
+        if (leader.empty())
+        {
+            const std::string lease_holder = lease.other_holder_ip();
+            if (view->is_coordinator && (lease.may_lead(std::chrono::steady_clock::now()) || lease_holder.empty()))
+            {
+                LogEntry e = entry;
+                // Far enough ahead that the relay gets there first, then everyone applies it at the same moment
+                if (clock.synced())
+                    e.execute_at_us = clock.room_now_us() + std::chrono::duration_cast<std::chrono::microseconds>(options.command_lead).count();
+
+                Message out{ MessageType::APPEND_ENTRIES };
+                out.ae = commands.append(lease.epoch(), e);
+                const LogEntry& appended = out.ae.entries.back();
+                player.schedule(appended, local_time_of(appended.execute_at_us, clock));
+
+                // Region leaders pass it on inside their own region
+                std::vector<Client> targets = cl.clients;
+                targets.insert(targets.end(), cl.upstream.begin(), cl.upstream.end());
+                relay_to_all_clients(out, targets, cl.bully_id, relay, std::format("command {}", appended.index));
+                return;
+            }
+            // Our view may be stale, the lease holder is the one writing the log
+            leader = lease_holder.empty() ? view->leader_ip : lease_holder;
+        }
+
+        if (leader.empty())
+        {
+            INFO("No leader to send the command from {} to, dropping it", ip);
+            return;
+        }
+        // Mid handoff the two ends can each think the other leads, the player rolls it back if it never lands
+        if (leader == ip || msg.cm.hops >= options.max_command_hops)
+        {
+            INFO("Not sending the command from {} on to {} after {} hops, dropping it", ip, leader, +msg.cm.hops);
+            return;
+        }
+        INFO("Forwarding command from {} to the leader at {}", ip, leader);
+        Message forwarded = msg;
+        forwarded.cm.hops++;
+        relay_to_all_clients(forwarded, {Client{leader, LISTENER_SERVER_PORT, 0}}, cl.bully_id, relay, "command");
+    }
+
+    static bool cm_handler(const Message& msg, player::MusicPlayer& player, const ClientList& cl, const bully_election& election, leader_lease& lease, fanout& relay, const clock_sync& clock, command_log& commands, const listener_options& options, std::string_view ip)
+    {
+        INFO("Listener recieved CONTROL_MUSIC");
+        LogEntry entry{};
+        entry.op = msg.cm.op;
+        entry.origin = msg.cm.origin;
+        entry.tag = msg.cm.tag;
+        submit(msg, entry, player, cl, election, lease, relay, clock, commands, options, ip);
         return false;
     }
 
-    static bool cs_handler(ChangeSong& cs, player::MusicPlayer& player)
+    static bool cs_handler(ChangeSong& cs, player::MusicPlayer& player, const ClientList& cl, fanout& relay)
     {
         INFO("Listener recieved CHANGE_SONG");
-        if (cs.add_to_queue)
-            player.add_to_queue(cs.song_id);
+        if (!cs.add_to_queue)
+            return false;
+
+        // Queued here right away, the other listeners merge it in whenever it gets to them
+        const std::optional<QueueItem> item = player.add_to_queue(cs.song_id);
+        if (!item)
+            return false;
+
+        Message msg{ MessageType::QUEUE_DELTA };
+        msg.qd.items = {*item};
+        msg.qd.ask_back = false;
+        msg.qd.queue_digest = 0;
+        std::vector<Client> targets = cl.clients;
+        targets.insert(targets.end(), cl.upstream.begin(), cl.upstream.end());
+        relay_to_all_clients(msg, targets, cl.bully_id, relay, "queued song");
+        return false;
+    }
+
+    static bool qd_handler(QueueDelta& qd, player::MusicPlayer& player, const ClientList& cl, const bully_election& election, fanout& relay, const std::string& ip)
+    {
+        const bool changed = player.merge_queue(qd);
+
+        if (qd.ask_back)
+        {
+            // Part of a snapshot, they might still be missing something of ours
+            if (player.digest().queue_digest != qd.queue_digest)
+                send_queue_snapshot(ip, player, relay, false);
+            return false;
+        }
+
+        // Songs queued in other regions only get here through us, and only new ones go on so nothing goes round in circles
+        const auto view = election.view();
+        const bool from_our_region = view->local_ips.contains(ip);
+        if (changed && view->is_region_leader && !from_our_region)
+        {
+            Message msg{ MessageType::QUEUE_DELTA };
+            msg.qd = qd;
+            relay_to_all_clients(msg, cl.clients, cl.bully_id, relay, "queued song");
+        }
+        return false;
+    }
+
+    static bool ae_handler(AppendEntries& ae, player::MusicPlayer& player, const ClientList& cl, const bully_election& election, leader_lease& lease, fanout& relay, const clock_sync& clock, command_log& commands, const std::string& ip, network& background)
+    {
+        const auto view = election.view();
+        if (view->is_coordinator && lease.may_lead(std::chrono::steady_clock::now()))
+            return false;
+        const bool from_region_leader = ip == view->region_leader_ip && !view->is_region_leader;
+        if (from_region_leader ? !lease.accepts_relayed(ae.term) : !lease.accepts_push(ip, ae.term))
+        {
+            INFO("Dropping commands from {} under lease {}, it doesn't hold the lease", ip, ae.term);
+            return false;
+        }
+
+        constexpr int max_fetches = 16;
+        follow_log(ae, false, max_fetches, player, lease, clock, relay, commands, ip, background);
+
+        if (view->is_region_leader && view->upstream_ips.contains(ip))
+        {
+            Message msg{ MessageType::APPEND_ENTRIES };
+            msg.ae = ae;
+            relay_to_all_clients(msg, cl.clients, cl.bully_id, relay, "commands");
+        }
         return false;
     }
 
+    static bool lf_handler(LogFetch& lf, const bully_election& election, leader_lease& lease, command_log& commands, std::span<char> wbuf)
+    {
+        // Whoever sent the entries answers for them
+        const auto view = election.view();
+        const bool leading = view->is_coordinator && lease.may_lead(std::chrono::steady_clock::now());
+        if (!leading && !view->is_region_leader)
+            return false;
+
+        Message msg{ MessageType::APPEND_ENTRIES };
+        msg.ae = commands.since(lf.from_index);
+        write_message_to_buffer(wbuf, msg);
+        return true;
+    }
+
     static bool dc_handler(Disconnect& dc, player::MusicPlayer& player)
     {
         INFO("Listener recieved DISCONNECT");
         return false;
     }
 
-    static bool cn_handler(Connect& cn)
+    static void send_connect_msg(const std::string& connector_ip, const std::uint16_t connector_port)
+    {
+        network net;
+        std::array<char, 1024> rb;
+        std::array<char, 1024> wb;
+
+        std::function write = [](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
+        {
+            Message msg{ MessageType::CONNECT };
+            write_message_to_buffer(write_buf, msg);
+            return false;
+        };
+
+        hnoker::timeout_handler th = [&]()
+        {
+            INFO("Failed to send CONNECT to connect node at {}:{}! Connection timed out.", connector_ip, connector_port);
+        };
+
+        net.async_connect_server(connector_ip, connector_port, rb, wb, write, th);
+        net.run();
+    }
+
+    // Joins the connector turned away are tried again from here, so nothing is left running after the listener returns
+    class join_retry
+    {
+    public:
+        explicit join_retry(endpoint_set& connectors) :
+            connectors(connectors),
+            thread([this](std::stop_token st) { run(st); })
+        {}
+
+        // A later answer replaces the wait from an earlier one
+        void after(std::chrono::milliseconds wait)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                due = std::chrono::steady_clock::now() + wait;
+            }
+            wake.notify_one();
+        }
+
+    private:
+        void run(std::stop_token st)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!st.stop_requested())
+            {
+                if (!due)
+                {
+                    wake.wait(lock, st, [this]() { return due.has_value(); });
+                    continue;
+                }
+                const auto until = *due;
+                if (wake.wait_until(lock, st, until, [&]() { return due != until; }) || st.stop_requested())
+                    continue;
+
+                due.reset();
+                lock.unlock();
+                const endpoint connector = connectors.current();
+                send_connect_msg(connector.ip, connector.port);
+                lock.lock();
+            }
+        }
+
+        endpoint_set& connectors;
+        std::mutex mutex;
+        std::condition_variable_any wake;
+        std::optional<std::chrono::steady_clock::time_point> due;
+        std::jthread thread;
+    };
+
+    static bool cn_handler(Connect& cn, join_retry& rejoin)
     {
         INFO("Listener recieved CONNECT");
+        if (cn.retry_after_ms == 0)
+            return false;
+
+        // Spread the retries out so a rejected crowd doesn't come back all at once
+        static std::mt19937 gen{std::random_device{}()};
+        std::uniform_int_distribution<std::uint32_t> jitter{0, cn.retry_after_ms / 2};
+        auto wait = std::chrono::milliseconds(cn.retry_after_ms + jitter(gen));
+
+        INFO("Connector is busy, trying to join again in {} ms", wait.count());
+        rejoin.after(wait);
         return false;
     }
 
@@ -149,100 +580,535 @@ namespace hnoker
         return false;
     }
 
-    static bool ss_handler(SendStatus& ss, player::MusicPlayer& player, ClientList& listener_state, std::string_view ip, std::span<char> rbuf, std::span<char> wbuf)
+    static bool ss_handler(SendStatus& ss, std::uint64_t sent_at, player::MusicPlayer& player, const bully_election& election, leader_lease& lease, const clock_sync& clock, fanout& relay, const std::string& ip)
     {
         INFO("Listener recieved SEND_STATUS, checking for desync");
-        const SendStatus& ps = player.get_status();
 
-        if (is_this_coordinator(listener_state))
+        if (election.view()->is_coordinator)
         {
-            if (ps != ss)
+            // Sent before our last change got anywhere, so it can't have it. Anything sent
+            // later may well have, the schedule and the digests catch what it still misses.
+            if (sent_at <= player.last_change())
             {
-                INFO("Coordinator detected desync! sending state");
-                for (auto& c : listener_state.clients)
+                if (!lease.may_lead(std::chrono::steady_clock::now()) || !clock.synced())
                 {
-                    if (listener_state.bully_id != c.bully_id)
-                        send_player_status(c.ip, rbuf, wbuf, player);
+                    INFO("Coordinator detected desync but can't lead, not answering {}", ip);
+                    return false;
                 }
+
+                // Only the sender is behind. Our schedule carries the digest, so it asks for
+                // the delta itself if its queue differs too.
+                INFO("Coordinator detected desync, sending {} our schedule", ip);
+                Message msg{ MessageType::PLAYBACK_SCHEDULE };
+                msg.ps = player.get_schedule(clock.room_now_us());
+                msg.ps.lease_epoch = lease.epoch();
+                relay.send({ip}, LISTENER_SERVER_PORT, msg, std::format("schedule {}", ip));
             }
         }
+        else if (!lease.accepts_push(ip, ss.lease_epoch))
+        {
+            INFO("Dropping state from {} under lease {}, it doesn't hold the lease", ip, ss.lease_epoch);
+        }
+        else if (!player.accept_push(ss.lease_epoch, sent_at))
+        {
+            INFO("Dropping state from {}, it was sent before what we already have", ip);
+        }
         else
         {
-            player.set_status(ps);
+            player.set_status(ss);
+        }
+
+        return false;
+    }
+
+    static void broadcast_schedule(player::MusicPlayer& player, const ClientList& cl, const clock_sync& clock, leader_lease& lease, fanout& relay)
+    {
+        Message msg{ MessageType::PLAYBACK_SCHEDULE };
+        // The queue stays home, whoever has a different one asks for it
+        msg.ps = player.get_schedule(clock.room_now_us());
+        msg.ps.lease_epoch = lease.epoch();
+
+        std::vector<std::string> targets;
+        for (const auto* clients : {&cl.clients, &cl.upstream})
+        {
+            for (const Client& c : *clients)
+            {
+                if (c.bully_id != cl.bully_id)
+                    targets.push_back(c.ip);
+            }
+        }
+        // Only the newest one matters
+        relay.send(targets, LISTENER_SERVER_PORT, msg, "schedule");
+    }
+
+    static bool ps_handler(PlaybackSchedule& ps, std::uint64_t sent_at, player::MusicPlayer& player, const ClientList& cl, const bully_election& election, leader_lease& lease, fanout& relay, const clock_sync& clock, const std::string& ip, network& background)
+    {
+        const auto view = election.view();
+        if (view->is_coordinator && lease.may_lead(std::chrono::steady_clock::now()))
+            return false;
+        // Our region leader passes on what the lease holder sent it
+        const bool from_region_leader = ip == view->region_leader_ip && !view->is_region_leader;
+        if (from_region_leader ? !lease.accepts_relayed(ps.lease_epoch) : !lease.accepts_push(ip, ps.lease_epoch))
+        {
+            INFO("Dropping playback schedule from {} under lease {}, it doesn't hold the lease", ip, ps.lease_epoch);
+            return false;
         }
+        if (!clock.synced())
+            return false;
+        // Relays can get schedules here out of order
+        if (!player.accept_push(ps.lease_epoch, sent_at))
+            return false;
 
+        if (player.follow_schedule(ps, clock.room_now_us()))
+            sync_state_with(ip, player, lease, clock, relay, background);
+
+        if (view->is_region_leader && view->upstream_ips.contains(ip))
+        {
+            Message msg{ MessageType::PLAYBACK_SCHEDULE };
+            msg.ps = ps;
+            std::vector<std::string> targets;
+            for (const Client& c : cl.clients)
+            {
+                if (c.bully_id != cl.bully_id)
+                    targets.push_back(c.ip);
+            }
+            relay.send(targets, LISTENER_SERVER_PORT, msg, "schedule");
+        }
         return false;
     }
 
-    static bool bl_handler(Bully& bl)
+    static bool sd_handler(StateDigest& sd, player::MusicPlayer& player, const bully_election& election, leader_lease& lease, const clock_sync& clock, fanout& relay, const std::string& ip, std::span<char> wbuf)
     {
-        INFO("Listenere recieved BULLY");
+        // Only whoever pushes the schedule to the asker has the state to answer with
+        const auto view = election.view();
+        const bool leading = view->is_coordinator && lease.may_lead(std::chrono::steady_clock::now());
+        if (!leading && !view->is_region_leader)
+            return false;
+        if (player.matches(sd.digest))
+            return false;
+        const StateDigest own = player.digest();
+
+        if (sd.queue_digest != own.queue_digest)
+        {
+            if (auto delta = player.changes_since(sd.state_epoch))
+            {
+                Message msg{ MessageType::STATE_DELTA };
+                msg.dl = std::move(*delta);
+                msg.dl.lease_epoch = lease.epoch();
+                write_message_to_buffer(wbuf, msg);
+                return true;
+            }
+            // The log doesn't go back that far, the queue goes separately and the timing in the answer
+            send_queue_snapshot(ip, player, relay, true);
+        }
+
+        Message msg{ MessageType::PLAYBACK_SCHEDULE };
+        msg.ps = player.get_schedule(clock.room_now_us());
+        msg.ps.lease_epoch = lease.epoch();
+        write_message_to_buffer(wbuf, msg);
+        return true;
+    }
+
+    static bool bl_handler(Bully& bl, bully_election& election, const std::string& sender_ip)
+    {
+        election.handle_message(bl, sender_ip);
         return false;
     }
 
-    static bool cl_handler(ClientList& cl, ClientList& listener_state)
+    static bool cl_handler(const ClientList& cl, listener_membership& membership, gossip_membership* gossip, bully_election& election)
     {
         INFO("Listener recieved CONNECTOR_LIST, bully_id : {}", cl.bully_id);
-        listener_state.bully_id = cl.bully_id;
+        bool new_id = false;
+        membership.update([&](ClientList& state)
+        {
+            // The id can come both over the membership stream and as a CONNECTOR_LIST
+            new_id = state.bully_id != cl.bully_id;
+            state.bully_id = cl.bully_id;
+            state.upstream = cl.upstream;
+        }, election);
+        election.start(cl.bully_id);
+
+        // Gossip calls back into the membership, so never while it is being updated
+        if (gossip && new_id)
+        {
+            gossip->start(cl.bully_id, [&membership, &election](const std::vector<Client>& members)
+            {
+                INFO("Gossip membership changed, {} members", members.size());
+                membership.update([&](ClientList& state) { state.clients = members; }, election);
+            });
+        }
         return false;
     }
 
-    static bool clu_handler(ClientListUpdate& clu, ClientList& listener_state)
+    static bool clu_handler(ClientListUpdate& clu, listener_membership& membership, gossip_membership* gossip, bully_election& election)
     {
-        INFO("Listener recieved CONNECTOR_LIST_UPDATE");
-        listener_state.clients = clu.clients;
+        INFO("Listener recieved CONNECTOR_LIST_UPDATE part {} of {}", clu.part + 1, clu.parts);
+        const std::optional<ClientListUpdate> whole = membership.assemble(clu);
+        if (!whole)
+            return false;
+        membership.update([&](ClientList& state)
+        {
+            state.upstream = whole->upstream;
+            if (!gossip)
+                state.clients = whole->clients;
+        }, election);
+        if (gossip)
+            gossip->merge(whole->clients);
         return false;
     }
 
-    static bool message_handler(Message& msg, player::MusicPlayer& player, std::span<char> rbuf, std::span<char> wbuf, ClientList& listener_state, const std::string_view ip, std::uint16_t port)
+    static bool gs_handler(Gossip& gs, gossip_membership* gossip, const std::string& sender_ip)
     {
+        if (!gossip)
+        {
+            INFO("Listener recieved GOSSIP but gossip membership is disabled");
+            return false;
+        }
+        gossip->handle_message(gs, sender_ip);
+        return false;
+    }
+
+    static bool hb_handler(Heartbeat& hb)
+    {
+        INFO("Listener recieved HEARTBEAT, those are meant for the connector");
+        return false;
+    }
+
+    struct membership_subscription
+    {
+        std::uint32_t epoch = 0;
+        std::uint64_t seq = 0;
+        std::vector<Client> members;
+        // A snapshot still coming in, members only takes it once it is complete
+        std::vector<Client> incoming;
+        std::uint16_t next_part = 0;
+        std::vector<Client> incoming_upstream;
+        std::uint16_t next_upstream_part = 0;
+        bool subscribed = false;
+        bool lost_track = false;
+    };
+
+    static void me_handler(MembershipEvents& me, membership_subscription& sub, listener_membership& membership, gossip_membership* gossip, bully_election& election)
+    {
+        if (me.upstream_parts > 0)
+        {
+            // Upstream frames sit outside the sequence numbers, the stream only keeps them in order
+            if (me.upstream_part == 0)
+            {
+                sub.incoming_upstream.clear();
+            }
+            else if (me.upstream_part != sub.next_upstream_part)
+            {
+                INFO("Upstream part {} came after {}, resubscribing", me.upstream_part, sub.next_upstream_part);
+                sub.lost_track = true;
+                return;
+            }
+            sub.incoming_upstream.insert(sub.incoming_upstream.end(), me.upstream.begin(), me.upstream.end());
+            sub.next_upstream_part = me.upstream_part + 1;
+            if (sub.next_upstream_part < me.upstream_parts)
+                return;
+
+            sub.next_upstream_part = 0;
+            membership.update([&](ClientList& state) { state.upstream = std::move(sub.incoming_upstream); }, election);
+            sub.incoming_upstream.clear();
+            return;
+        }
+
+        if (me.snapshot)
+        {
+            if (me.part == 0)
+            {
+                sub.incoming.clear();
+            }
+            else if (me.part != sub.next_part)
+            {
+                INFO("Membership snapshot part {} came after {}, resubscribing", me.part, sub.next_part);
+                sub.lost_track = true;
+                return;
+            }
+            sub.incoming.insert(sub.incoming.end(), me.clients.begin(), me.clients.end());
+            sub.next_part = me.part + 1;
+            if (sub.next_part < me.parts)
+                return;
+
+            INFO("Membership snapshot at {} with {} members", me.seq, sub.incoming.size());
+            sub.members = std::move(sub.incoming);
+            sub.incoming.clear();
+            sub.next_part = 0;
+            if (me.bully_id != 0 && me.bully_id != membership.get().bully_id)
+            {
+                ClientList cl{ me.bully_id, {}, membership.get().upstream };
+                cl_handler(cl, membership, gossip, election);
+            }
+        }
+        else
+        {
+            if (me.epoch != sub.epoch || me.seq - me.updates.size() != sub.seq)
+            {
+                INFO("Membership stream skipped from {} to {}, resubscribing", sub.seq, me.seq);
+                sub.lost_track = true;
+                return;
+            }
+
+            for (const MemberUpdate& u : me.updates)
+            {
+                std::erase_if(sub.members, [&](const Client& c) { return c.ip == u.client.ip; });
+                if (u.state == MemberState::ALIVE)
+                    sub.members.push_back(u.client);
+            }
+        }
+
+        sub.epoch = me.epoch;
+        sub.seq = me.seq;
+        if (!gossip)
+            membership.update([&](ClientList& state) { state.clients = sub.members; }, election);
+        else
+            gossip->merge(sub.members);
+    }
+
+    static void run_heartbeats(std::stop_token st, endpoint_set& connectors, player::MusicPlayer& player, listener_membership& membership, gossip_membership* gossip, bully_election& election, leader_lease& lease, const listener_options& options)
+    {
+        std::array<char, 1024> rb;
+        std::array<char, 1024> wb;
+        std::uint32_t seq = 0;
+        membership_subscription sub;
+
+        frame_producer beat = [&](std::span<char> write_buf) -> bool
+        {
+            if (st.stop_requested())
+                return false;
+
+            Message msg{ MessageType::HEARTBEAT };
+            msg.hb = player.get_heartbeat();
+            msg.hb.bully_id = membership.get().bully_id;
+            msg.hb.seq = ++seq;
+            msg.hb.rank = election.own_rank();
+            // Only the stream carries the answer back
+            msg.hb.wants_lease = options.persistent_heartbeat && election.view()->is_coordinator;
+            if (msg.hb.wants_lease)
+                lease.requested(std::chrono::steady_clock::now());
+            msg.hb.hand_lease_to = lease.handing_to();
+            write_message_to_buffer(write_buf, msg);
+            return true;
+        };
+
+        // The first frame on a new stream picks the membership stream up where we left off
+        frame_producer subscribe_then_beat = [&](std::span<char> write_buf) -> bool
+        {
+            if (sub.lost_track)
+                return false;
+            if (sub.subscribed)
+                return beat(write_buf);
+
+            Message msg{ MessageType::SUBSCRIBE };
+            msg.sb.epoch = sub.epoch;
+            msg.sb.resume_from = sub.seq;
+            write_message_to_buffer(write_buf, msg);
+            sub.subscribed = true;
+            return true;
+        };
+
+        frame_consumer pushed = [&](std::span<char> read_buf)
+        {
+            Message msg = read_message_from_buffer(read_buf);
+            if (msg.type == MessageType::MEMBERSHIP_EVENTS)
+                me_handler(msg.me, sub, membership, gossip, election);
+            else if (msg.type == MessageType::LEASE)
+                lease.update(msg.ls, membership.get().bully_id, std::chrono::steady_clock::now());
+            else
+                INFO("Ignoring message of type {} pushed by the connector", +static_cast<std::uint8_t>(msg.type));
+        };
+
+        bool delivered = false;
+        std::function write = [&](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
+        {
+            delivered = beat(write_buf);
+            return false;
+        };
+
+        INFO("Sending heartbeats every {} ms", options.heartbeat_interval.count());
+        while (!st.stop_requested())
+        {
+            const endpoint connector = connectors.current();
+            delivered = false;
+
+            const timeout_handler th = [&]()
+            {
+                INFO("Heartbeat to connector at {}:{} timed out", connector.ip, connector.port);
+            };
+
+            network net;
+            if (options.persistent_heartbeat)
+            {
+                // Only returns once the stream breaks, then we reconnect
+                sub.subscribed = false;
+                net.async_stream_to_server(connector.ip, connector.port, wb, subscribe_then_beat, options.heartbeat_interval, [&]()
+                {
+                    INFO("Heartbeat stream to connector {}:{} closed", connector.ip, connector.port);
+                }, rb, pushed);
+                net.run();
+
+                if (sub.lost_track)
+                {
+                    // The connector is fine, we just need to resubscribe
+                    sub.lost_track = false;
+                    continue;
+                }
+            }
+            else
+            {
+                net.async_connect_server(connector.ip, connector.port, rb, wb, write, th);
+                net.run();
+                if (delivered)
+                {
+                    std::this_thread::sleep_for(options.heartbeat_interval);
+                    continue;
+                }
+            }
+
+            if (st.stop_requested())
+                return;
+
+            // This connector is gone, move on to the next one and make sure it knows about us
+            connectors.failed(connector);
+            const endpoint next = connectors.current();
+            if (!(next == connector))
+                send_connect_msg(next.ip, next.port);
+            std::this_thread::sleep_for(options.heartbeat_interval);
+        }
+    }
+
+    static bool rs_handler(ReplicaSync& rs)
+    {
+        INFO("Listener recieved REPLICA_SYNC, those are meant for connector replicas");
+        return false;
+    }
+
+    static bool su_handler(RegionSummary& su)
+    {
+        INFO("Listener recieved REGION_SUMMARY, those are meant for connectors");
+        return false;
+    }
+
+    static bool message_handler(Message& msg, player::MusicPlayer& player, std::span<char> rbuf, std::span<char> wbuf, listener_membership& membership, gossip_membership* gossip, bully_election& election, leader_lease& lease, fanout& relay, const clock_sync& clock, command_log& commands, endpoint_set& connectors, join_retry& rejoin, network& background, const listener_options& options, const std::string& sender_ip, std::int64_t received_us)
+    {
+        const endpoint connector = connectors.current();
+        const std::string_view ip = connector.ip;
+        const std::uint16_t port = connector.port;
+        // One copy per message, whatever changes meanwhile applies to the next one
+        const ClientList listener_state = membership.get();
+
         switch (msg.type)
         {
             case MessageType::CONTROL_MUSIC:
-                return cm_handler(msg.cm, player, listener_state, ip, rbuf, wbuf);
+                return cm_handler(msg, player, listener_state, election, lease, relay, clock, commands, options, sender_ip);
             case MessageType::CHANGE_SONG:
-                return cs_handler(msg.cs, player);
+                return cs_handler(msg.cs, player, listener_state, relay);
             case MessageType::DISCONNECT:
                 return dc_handler(msg.dc, player);
             case MessageType::CONNECT:
-                return cn_handler(msg.cn);
+                return cn_handler(msg.cn, rejoin);
             case MessageType::QUERY_STATUS:
                 return qs_handler(msg.qs, player, rbuf, wbuf, ip, port);
             case MessageType::SEND_STATUS:
-                return ss_handler(msg.ss, player, listener_state, ip, rbuf, wbuf);
+                return ss_handler(msg.ss, msg.hlc, player, election, lease, clock, relay, sender_ip);
             case MessageType::BULLY:
-                return bl_handler(msg.bl);
+                return bl_handler(msg.bl, election, sender_ip);
+            case MessageType::PLAYBACK_SCHEDULE:
+                return ps_handler(msg.ps, msg.hlc, player, listener_state, election, lease, relay, clock, sender_ip, background);
+            case MessageType::STATE_DIGEST:
+                return sd_handler(msg.sd, player, election, lease, clock, relay, sender_ip, wbuf);
+            case MessageType::QUEUE_DELTA:
+                return qd_handler(msg.qd, player, listener_state, election, relay, sender_ip);
+            case MessageType::STATE_DELTA:
+                // Only ever an answer on the connection that asked for it
+                return false;
+            case MessageType::APPEND_ENTRIES:
+                return ae_handler(msg.ae, player, listener_state, election, lease, relay, clock, commands, sender_ip, background);
+            case MessageType::LOG_FETCH:
+                return lf_handler(msg.lf, election, lease, commands, wbuf);
+            case MessageType::TIME_SYNC:
+                // Answered on the same connection, only the leader's clock is worth syncing to
+                if (msg.ts.reply || !election.view()->is_coordinator)
+                    return false;
+                clock_sync::answer(msg.ts, received_us, wbuf);
+                return true;
             case MessageType::CONNECTOR_LIST:
-                return cl_handler(msg.cl, listener_state);
+                return cl_handler(msg.cl, membership, gossip, election);
             case MessageType::CONNECTOR_LIST_UPDATE:
-                return clu_handler(msg.cu, listener_state);
+                return clu_handler(msg.cu, membership, gossip, election);
+            case MessageType::GOSSIP:
+                return gs_handler(msg.gs, gossip, sender_ip);
+            case MessageType::HEARTBEAT:
+                return hb_handler(msg.hb);
+            case MessageType::REPLICA_SYNC:
+                return rs_handler(msg.rs);
+            case MessageType::REGION_SUMMARY:
+                return su_handler(msg.su);
+            case MessageType::SUBSCRIBE:
+            case MessageType::MEMBERSHIP_EVENTS:
+            case MessageType::LEASE:
+                INFO("Listener recieved a membership stream message outside of a stream, ignoring");
+                return false;
         }
         return false;
     }
 
-    void start_listener(const std::string_view connector_ip, const uint16_t connector_port)
+    void start_listener(const std::vector<endpoint>& connector_endpoints, const listener_options& options)
     {
         INFO("Starting listener");
 
-        player::MusicPlayer player(1);
-        ClientList listener_state_cl;
+        player::MusicPlayer player(1, options.drift);
+        listener_membership membership;
 
-        std::array<char, 1024> client_rb;
-        std::array<char, 1024> client_wb;
-        std::array<char, 1024> server_rb;
-        std::array<char, 1024> server_wb;
+        endpoint_set connectors{connector_endpoints};
+        const endpoint first_connector = connectors.current();
+        const std::string connector_ip = first_connector.ip;
+        const std::uint16_t connector_port = first_connector.port;
 
-        network listener_server_network;
+        // Declared in the order their callbacks need each other, so each is torn down before what it uses
+        leader_lease lease{options.lease, options.persistent_heartbeat};
+        bully_election election{options.election};
+        std::unique_ptr<gossip_membership> gossip;
+        if (options.gossip)
+            gossip = std::make_unique<gossip_membership>(options.gossip_opts, [&connectors]() { return connectors.current(); });
+        fanout relay{options.relay};
+        clock_sync clock{options.clock, [&election]() { return election.view(); }};
+        clock.start();
+        command_log commands{options.log};
+        // The successor gets our full playback state before it is announced
+        const bully_election::handoff_sync sync_successor = [&player, &lease](const Client& successor)
+        {
+            std::array<char, 1024> rb;
+            std::array<char, 1024> wb;
+            send_player_status(successor.ip, rb, wb, player, lease.epoch());
+            // Then the lease follows, otherwise it would keep sending commands back to us
+            lease.hand_over(successor.bully_id);
+        };
+        election.set_handoff_sync(sync_successor);
+
+        join_retry rejoin{connectors};
+
+        // Catching up asks the leader and waits for the answer, that happens here instead of holding up the server
+        network background;
+        std::jthread background_thread { [&background]() {
+            background.run_until_stopped();
+        }};
 
-        Message connect_msg = { MessageType::CONNECT };
+        std::array<char, 1024> client_rb;
+        std::array<char, 1024> client_wb;
+        const Message connect_msg = { MessageType::CONNECT };
 
-        static std::function server = [connector_ip, connector_port, &player, &listener_state_cl](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
+        // The network only holds on to these by reference, so they have to outlive it
+        const read_write_op_t server = [&](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
         {
+            // Taken as soon as the read is done, TIME_SYNC answers count from here
+            const std::int64_t received_us = clock_sync::local_us();
             Message msg = read_message_from_buffer(read_buf);
-            return message_handler(msg, player,read_buf, write_buf, listener_state_cl, connector_ip, connector_port);
+            return message_handler(msg, player,read_buf, write_buf, membership, gossip.get(), election, lease, relay, clock, commands, connectors, rejoin, background, options, ip, received_us);
         };
 
-        static std::function send_connect = [&connect_msg](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
+        const read_write_op_t send_connect = [&connect_msg](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port) -> bool
         {
             write_message_to_buffer(write_buf, connect_msg);
             return true;
@@ -253,17 +1119,55 @@ namespace hnoker
             INFO("Failed to send CONNECT to connect node at {}:{}! Connection timed out.", connector_ip, connector_port);
         };
 
-        listener_server_network.async_create_server(LISTENER_SERVER_PORT, server_rb, server_wb, server, [](){});
+        network listener_server_network;
+        listener_server_network.async_create_server(LISTENER_SERVER_PORT, server, [](){});
         listener_server_network.async_connect_server(connector_ip, connector_port, client_rb, client_wb, send_connect, thandler);
 
-        std::jthread th { [&]() {
+        std::jthread server_thread { [&listener_server_network]() {
             listener_server_network.run();
         }};
 
-        th.detach();
-           
-        player.start_player(listener_state_cl);
+        std::jthread heartbeat { [&](std::stop_token st) {
+            run_heartbeats(st, connectors, player, membership, gossip.get(), election, lease, options);
+        }};
+
+        // The leader keeps everyone's position in line, so nobody has to push status around
+        std::jthread schedule_sender { [&](std::stop_token st) {
+            std::mutex sleep_mutex;
+            std::condition_variable_any sleeper;
+            while (!st.stop_requested())
+            {
+                {
+                    std::unique_lock<std::mutex> lock(sleep_mutex);
+                    sleeper.wait_for(lock, st, options.schedule_interval, []() { return false; });
+                }
+                if (election.view()->is_coordinator && lease.may_lead(std::chrono::steady_clock::now()) && clock.synced())
+                    broadcast_schedule(player, membership.get(), clock, lease, relay);
+            }
+        }};
+
+        std::signal(SIGINT, on_shutdown_signal);
+        std::signal(SIGTERM, on_shutdown_signal);
+        std::jthread signal_watch { [&player](std::stop_token st) {
+            while (!st.stop_requested() && !shutdown_signalled)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (shutdown_signalled)
+                player.stopper.request_stop();
+        }};
+
+        // Playback control goes to whoever won the last election, returns when the window
+        // is closed or we are told to stop
+        player.start_player([&membership]() { return membership.get(); }, [&election]() { return election.view()->leader_ip; });
+
+        // Shutting down, don't leave the room to time out on us
+        if (election.hand_off(sync_successor))
+            INFO("Handed leadership off before shutting down");
 
+        // Everything below is joined before the state it uses goes away
+        listener_server_network.stop();
+        server_thread.join();
+        background.stop();
+        background_thread.join();
     }
 
   }
@@ -1,10 +1,51 @@
-#pragma once
-
-#include "string_view"
-
-namespace hnoker
-{
-    void start_listener(const std::string_view connector_ip, const uint16_t connector_port);
-}
-
-
+#pragma once
+
+#include "clock_sync.hpp"
+#include "command_log.hpp"
+#include "election.hpp"
+#include "fanout.hpp"
+#include "gossip.hpp"
+#include "lease.hpp"
+#include "networking.hpp"
+#include "player.hpp"
+#include "string_view"
+
+#include <chrono>
+#include <vector>
+
+namespace hnoker
+{
+    struct listener_options
+    {
+        // Detect failures with SWIM gossip between listeners instead of connector polling
+        bool gossip = false;
+        gossip_options gossip_opts{};
+
+        std::chrono::milliseconds heartbeat_interval{HEARTBEAT_INTERVAL_MS};
+        // Send heartbeats over one long lived connection instead of a new one each time
+        bool persistent_heartbeat = true;
+
+        election_options election{};
+        // Only used with the persistent heartbeat, the lease is granted over it
+        lease_options lease{};
+        // CONTROL_MUSIC goes out to every listener at once, each gets this long
+        fanout_options relay{256, std::chrono::milliseconds(300)};
+        // Followers keep their clock in step with the leader's
+        clock_sync_options clock{};
+        // How far ahead the leader schedules commands, long enough for the relay to reach everyone
+        std::chrono::milliseconds command_lead{150};
+        // Commands passed on more often than this are dropped, views disagree until an election settles
+        std::uint8_t max_command_hops = 3;
+        // How often the leader tells everyone where playback should be
+        std::chrono::milliseconds schedule_interval{2000};
+        // Player commands go through the leader's log
+        command_log_options log{};
+        // Small offsets from the leader are played out instead of jumped over
+        player::DriftOptions drift{};
+    };
+
+    // Connectors are tried in order, the listener moves on to the next one when its current one fails
+    void start_listener(const std::vector<endpoint>& connectors, const listener_options& options = {});
+}
+
+
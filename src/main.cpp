@@ -9,9 +9,12 @@
 #define RAYGUI_IMPLEMENTATION
 #include "raygui.h"
 
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <fstream>
 #include <functional>
+#include <optional>
 #include <span>
 #include <string>
 #include <thread>
@@ -22,9 +25,6 @@ void test_networking_archives_singlemessage()
 {
     hnoker::network network;
 
-    std::vector<char> server_rbuf(1024);
-    std::vector<char> server_wbuf(1024);
-
     std::array<char, 1024> client_rbuf;
     std::array<char, 1024> client_wbuf;
 
@@ -60,7 +60,7 @@ void test_networking_archives_singlemessage()
     };
 
     // Tää omaan threadiin, mul meni joku puol tuntii tajuta et toi run on blokkaava calli xd
-    std::jthread xd([&]() mutable { network.async_create_server(LISTENER_SERVER_PORT, server_rbuf, server_wbuf, read_write_op, hnoker::default_timeout_handler); network.run(); });
+    std::jthread xd([&]() mutable { network.async_create_server(LISTENER_SERVER_PORT, read_write_op, hnoker::default_timeout_handler); network.run(); });
 
     // Uuus viesti queueen joka kerta
     while (true)
@@ -105,7 +105,7 @@ void test_connector()
 
     hnoker::network server_network;
 
-    std::jthread xd2blyat([&]() { server_network.async_create_server(LISTENER_SERVER_PORT, client_rbuf, client_wbuf, server_callback, hnoker::default_timeout_handler); server_network.run(); });
+    std::jthread xd2blyat([&]() { server_network.async_create_server(LISTENER_SERVER_PORT, server_callback, hnoker::default_timeout_handler); server_network.run(); });
     xd2blyat.detach();
 
     while (true)
@@ -123,8 +123,7 @@ void test_listener()
 {
     std::jthread xdc{ []() { start_connector();} };
     xdc.detach();
-    std::string conn_ip = "127.0.0.1";
-    hnoker::start_listener(conn_ip, CONNECTOR_SERVER_PORT);
+    hnoker::start_listener({ { "127.0.0.1", CONNECTOR_SERVER_PORT } });
 }
 
 void test_player()
@@ -175,13 +174,34 @@ string_map parse_cmd_arg(std::vector<std::string> as, Keyword keyword)
     return result;
 }
 
+// Empty when the whole text isn't a number of that type
+template <class T>
+std::optional<T> parse_number(const std::string& text)
+{
+    T value{};
+    const char* end = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    if (ec != std::errc{} || ptr != end)
+        return std::nullopt;
+    return value;
+}
+
 int main(int argc, const char* argv[])
 {
     std::vector<std::string> args(argv + 1, argv + argc);
     std::unordered_map<std::string, std::string> keys = 
     {
         { "--mode", "mode" },
-        { "--test", "test" }
+        { "--test", "test" },
+        { "--gossip", "gossip" },
+        { "--phi-threshold", "phi-threshold" },
+        { "--connector", "connector" },
+        { "--port", "port" },
+        { "--replicas", "replicas" },
+        { "--replica-index", "replica-index" },
+        { "--parent", "parent" },
+        { "--region", "region" },
+        { "--state-dir", "state-dir" }
     };
 
     auto arg_map = parse_cmd_arg(args, [&](auto&& s) -> std::vector<std::string> {
@@ -194,14 +214,100 @@ int main(int argc, const char* argv[])
     std::string mode = arg_map.find("mode") != arg_map.end() ? arg_map["mode"].size() > 0 ? arg_map["mode"][0] : "" : "";
     std::string test = arg_map.find("test") != arg_map.end() ? arg_map["test"].size() > 0 ? arg_map["test"][0] : "" : "";
 
+    const bool gossip = arg_map.contains("gossip");
+
     if (mode == "listener")
     {
-        const char* conn_ip = "127.0.0.1";
-        hnoker::start_listener(conn_ip, CONNECTOR_SERVER_PORT);
+        std::vector<hnoker::endpoint> connectors;
+        for (const auto& c : arg_map["connector"])
+        {
+            if (auto ep = hnoker::parse_endpoint(c, CONNECTOR_SERVER_PORT))
+                connectors.push_back(*ep);
+            else
+                INFO("Ignoring bad connector address {}", c);
+        }
+        if (connectors.empty())
+            connectors.push_back({ "127.0.0.1", CONNECTOR_SERVER_PORT });
+
+        hnoker::listener_options options;
+        options.gossip = gossip;
+        hnoker::start_listener(connectors, options);
     }
     else if (mode == "connector")
     {
-        start_connector();
+        connector_options options;
+        options.gossip = gossip;
+        if (arg_map.contains("phi-threshold") && !arg_map["phi-threshold"].empty())
+        {
+            const auto phi = parse_number<double>(arg_map["phi-threshold"][0]);
+            if (!phi || !std::isfinite(*phi) || *phi <= 0.0)
+            {
+                CRITICAL("--phi-threshold needs a positive number, got {}", arg_map["phi-threshold"][0]);
+                return 1;
+            }
+            options.phi_threshold = *phi;
+        }
+        if (arg_map.contains("port") && !arg_map["port"].empty())
+        {
+            const auto port = parse_number<std::uint16_t>(arg_map["port"][0]);
+            if (!port || *port == 0)
+            {
+                CRITICAL("--port needs a number from 1 to 65535, got {}", arg_map["port"][0]);
+                return 1;
+            }
+            options.port = *port;
+        }
+        for (const auto& r : arg_map["replicas"])
+        {
+            if (auto ep = hnoker::parse_endpoint(r, CONNECTOR_SERVER_PORT))
+                options.replication.replicas.push_back(*ep);
+            else
+                INFO("Ignoring bad replica address {}", r);
+        }
+        if (arg_map.contains("replica-index") && !arg_map["replica-index"].empty())
+        {
+            // Our own entry in --replicas, so it has to be one of them
+            const auto index = parse_number<std::size_t>(arg_map["replica-index"][0]);
+            if (options.replication.replicas.empty())
+            {
+                CRITICAL("--replica-index needs --replicas to pick from");
+                return 1;
+            }
+            if (!index || *index >= options.replication.replicas.size())
+            {
+                CRITICAL("--replica-index needs a position in --replicas from 0 to {}, got {}", options.replication.replicas.size() - 1, arg_map["replica-index"][0]);
+                return 1;
+            }
+            options.replication.index = *index;
+        }
+        if (arg_map.contains("parent") && !arg_map["parent"].empty())
+        {
+            options.region.parent = hnoker::parse_endpoint(arg_map["parent"][0], CONNECTOR_SERVER_PORT);
+            if (!options.region.parent)
+                INFO("Ignoring bad parent address {}", arg_map["parent"][0]);
+        }
+        if (arg_map.contains("region") && !arg_map["region"].empty())
+        {
+            const auto region = parse_number<std::uint16_t>(arg_map["region"][0]);
+            if (!region)
+            {
+                CRITICAL("--region needs a number from 0 to 65535, got {}", arg_map["region"][0]);
+                return 1;
+            }
+            options.region.region = *region;
+        }
+        else if (options.region.parent)
+        {
+            // Children all defaulting to the same id would collide at the parent
+            CRITICAL("--parent needs a --region id that is unique under that parent");
+            return 1;
+        }
+        if (arg_map.contains("state-dir") && !arg_map["state-dir"].empty())
+        {
+            options.persistence.directory = arg_map["state-dir"][0];
+            options.persistence.name = "connector-" + std::to_string(options.port);
+        }
+        start_connector(options);
     }
     else if (test == "singlemessage")
     {
@@ -0,0 +1,143 @@
+#include "membership_log.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace hnoker
+{
+    static void apply_entry(std::vector<Client>& clients, char op, const Client& client)
+    {
+        const auto same_ip = [&](const Client& c) { return c.ip == client.ip; };
+        std::erase_if(clients, same_ip);
+        if (op == '+')
+            clients.push_back(client);
+    }
+
+    std::vector<Client> membership_log::open(const persistence_options& options)
+    {
+        if (options.directory.empty())
+            return {};
+
+        std::error_code ec;
+        std::filesystem::create_directories(options.directory, ec);
+        if (ec)
+        {
+            WARN("Could not create membership directory {}: {}, running without persistence", options.directory, ec.message());
+            return {};
+        }
+
+        snapshot_path = std::filesystem::path(options.directory) / (options.name + ".snapshot");
+        log_path = std::filesystem::path(options.directory) / (options.name + ".log");
+        snapshot_every = std::max<std::size_t>(options.snapshot_every, 1);
+
+        std::vector<Client> recovered = recover();
+
+        // Start from a clean snapshot so the log only holds what happens from now on
+        compact(recovered);
+        return recovered;
+    }
+
+    std::vector<Client> membership_log::recover() const
+    {
+        std::vector<Client> clients;
+
+        std::ifstream snapshot(snapshot_path);
+        if (snapshot)
+        {
+            try
+            {
+                boost::archive::text_iarchive ia(snapshot);
+                ia >> clients;
+            }
+            catch (const std::exception& e)
+            {
+                WARN("Membership snapshot {} is unreadable: {}", snapshot_path.string(), e.what());
+                clients.clear();
+            }
+        }
+        const std::size_t from_snapshot = clients.size();
+
+        std::ifstream in(log_path);
+        std::string line;
+        std::size_t replayed = 0;
+        while (std::getline(in, line))
+        {
+            std::istringstream entry(line);
+            char op;
+            Client client;
+            if (!(entry >> op >> client.ip >> client.port >> client.bully_id) || (op != '+' && op != '-'))
+                continue;
+            apply_entry(clients, op, client);
+            replayed++;
+        }
+
+        INFO("Recovered {} members, {} from the snapshot and {} log entries", clients.size(), from_snapshot, replayed);
+        return clients;
+    }
+
+    void membership_log::added(const Client& client)
+    {
+        if (!log.is_open())
+            return;
+        log << "+ " << client.ip << ' ' << client.port << ' ' << client.bully_id << '\n' << std::flush;
+        entries++;
+    }
+
+    void membership_log::removed(const Client& client)
+    {
+        if (!log.is_open())
+            return;
+        log << "- " << client.ip << ' ' << client.port << ' ' << client.bully_id << '\n' << std::flush;
+        entries++;
+    }
+
+    void membership_log::compact(const std::vector<Client>& clients)
+    {
+        if (snapshot_path.empty())
+            return;
+
+        // Written aside and renamed over, so a connector dying midway leaves either the old snapshot or the new one
+        std::filesystem::path tmp = snapshot_path;
+        tmp += ".tmp";
+        try
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out.is_open())
+            {
+                disable("Could not open membership snapshot " + tmp.string());
+                return;
+            }
+            boost::archive::text_oarchive oa(out);
+            oa << clients;
+        }
+        catch (const std::exception& e)
+        {
+            disable("Could not write membership snapshot " + tmp.string() + ": " + e.what());
+            return;
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmp, snapshot_path, ec);
+        if (ec)
+        {
+            WARN("Could not replace membership snapshot: {}", ec.message());
+            return;
+        }
+
+        log.close();
+        log.open(log_path, std::ios::trunc);
+        entries = 0;
+        if (!log.is_open())
+            disable("Could not open membership log " + log_path.string());
+    }
+
+    void membership_log::disable(const std::string& why)
+    {
+        // Nothing is written or compacted after this, the members just aren't recovered on a restart
+        WARN("{}, running without persistence", why);
+        log.close();
+        snapshot_path.clear();
+        log_path.clear();
+    }
+}
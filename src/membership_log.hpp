@@ -0,0 +1,54 @@
+#pragma once
+
+#include "message_types.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace hnoker
+{
+    struct persistence_options
+    {
+        // Where the snapshot and log are kept, empty turns persistence off
+        std::string directory;
+        std::string name = "connector";
+        // Log entries written before the table is snapshotted and the log emptied
+        std::size_t snapshot_every = 256;
+        // Recovered members are probed for this long instead of being evicted
+        std::chrono::milliseconds grace_period{3000};
+    };
+
+    // Membership snapshot plus an append only log of joins and leaves since it.
+    // Recovery loads the snapshot and replays the log, a torn last line is skipped.
+    // Writes are flushed to the OS but never synced, so they outlive the connector
+    // process but not the machine. Any file error turns persistence off instead of
+    // throwing. Not thread safe, the connector calls it under clients_mutex.
+    class membership_log
+    {
+    public:
+        // Opens the files and returns the recovered membership
+        std::vector<Client> open(const persistence_options& options);
+        bool enabled() const { return log.is_open(); }
+
+        void added(const Client& client);
+        void removed(const Client& client);
+
+        bool wants_compaction() const { return entries >= snapshot_every; }
+        // Replaces the snapshot with the full table and empties the log
+        void compact(const std::vector<Client>& clients);
+
+    private:
+        std::vector<Client> recover() const;
+        void disable(const std::string& why);
+
+        std::filesystem::path snapshot_path;
+        std::filesystem::path log_path;
+        std::ofstream log;
+        std::size_t entries = 0;
+        std::size_t snapshot_every = 0;
+    };
+}
@@ -26,6 +26,20 @@ enum struct MessageType : std::uint8_t {
     BULLY = 6,
     CONNECTOR_LIST = 7,
     CONNECTOR_LIST_UPDATE = 8,
+    GOSSIP = 9,
+    HEARTBEAT = 10,
+    REPLICA_SYNC = 11,
+    REGION_SUMMARY = 12,
+    SUBSCRIBE = 13,
+    MEMBERSHIP_EVENTS = 14,
+    LEASE = 15,
+    TIME_SYNC = 16,
+    PLAYBACK_SCHEDULE = 17,
+    STATE_DIGEST = 18,
+    STATE_DELTA = 19,
+    APPEND_ENTRIES = 20,
+    LOG_FETCH = 21,
+    QUEUE_DELTA = 22,
 };
 
 enum struct ControlOperation : std::uint8_t {
@@ -39,11 +53,19 @@ std::ostream& operator<< (std::ostream& stream, const ControlOperation& op);
 // CM
 struct ControlMusic {
     ControlOperation op;
+    // Which player sent it and its own number for it, so it knows the command when it comes back
+    std::uint32_t origin = 0;
+    std::uint32_t tag = 0;
+    // How many listeners passed it on towards the leader
+    std::uint8_t hops = 0;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
     {
         ar & op;
+        ar & origin;
+        ar & tag;
+        ar & hops;
     }
 };
 
@@ -74,11 +96,14 @@ struct Disconnect {
 // CN
 struct Connect {
     std::uint8_t dummy{};
+    // Set by the connector when it turns a join away, try again after this long
+    std::uint32_t retry_after_ms = 0;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
     {
         ar & dummy;
+        ar & retry_after_ms;
     }
 };
 
@@ -99,6 +124,10 @@ struct SendStatus {
     int elapsed_time;
     bool paused;
     std::deque<int> queue;
+    // Lease the sender led under when it pushes state, followers drop pushes from stale leaders
+    std::uint32_t lease_epoch = 0;
+    // Followers also drop pushes older than what they already have from the same lease
+    std::uint64_t state_epoch = 0;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
@@ -107,6 +136,8 @@ struct SendStatus {
         ar & elapsed_time;
         ar & paused;
         ar & queue;
+        ar & lease_epoch;
+        ar & state_epoch;
     }
 
     bool operator==(const SendStatus& rhs)
@@ -123,16 +154,25 @@ enum struct BullyType : std::uint8_t {
     ELECTION = 1,
     ANSWER = 2,
     VICTORY = 3,
+    // Only there to time a round trip, ignored by the receiver
+    PROBE = 4,
+    // Leader to its chosen successor, sent after the successor has its state
+    HANDOFF = 5,
 };
 
 // BL
 struct Bully {
     BullyType et;
+    // For VICTORY this is the leader, also when a region leader passes it on
+    std::uint16_t sender_id;
+    std::uint16_t sender_rank;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
     {
         ar & et;
+        ar & sender_id;
+        ar & sender_rank;
     }
 };
 
@@ -140,6 +180,8 @@ struct Client {
     std::string ip;
     std::uint16_t port;
     std::uint16_t bully_id;
+    // How well placed it is to lead as the listener last reported it, 0 when unknown
+    std::uint16_t rank = 0;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
@@ -147,6 +189,7 @@ struct Client {
         ar & ip;
         ar & port;
         ar & bully_id;
+        ar & rank;
     }
 
     bool operator==(const Client& rhs)
@@ -155,25 +198,434 @@ struct Client {
     }
 };
 
+// Leaders are picked by rank, the bully id only breaks ties
+inline bool outranks(std::uint16_t rank, std::uint16_t bully_id, std::uint16_t other_rank, std::uint16_t other_bully_id)
+{
+    return rank != other_rank ? rank > other_rank : bully_id > other_bully_id;
+}
+
+inline bool outranks(const Client& a, const Client& b)
+{
+    return outranks(a.rank, a.bully_id, b.rank, b.bully_id);
+}
+
 struct ClientList {
     std::uint16_t bully_id;
     std::vector<Client> clients;
+    // Leaders of the other regions when connectors form a tree, empty otherwise
+    std::vector<Client> upstream;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
     {
         ar & bully_id;
         ar & clients;
+        ar & upstream;
     }
 };
 
 struct ClientListUpdate {
     std::vector<Client> clients;
+    std::vector<Client> upstream;
+    // A list too long for one frame comes in parts, they can arrive in any order.
+    // Each part carries the next slice of clients and then upstream, both are joined back in order
+    std::uint32_t list_id = 0;
+    std::uint16_t part = 0;
+    std::uint16_t parts = 1;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & clients;
+        ar & upstream;
+        ar & list_id;
+        ar & part;
+        ar & parts;
+    }
+};
+
+enum struct GossipType : std::uint8_t {
+    PING = 1,
+    PING_REQ = 2,
+    ACK = 3,
+    // Confirmed failures, for the connector
+    REPORT = 4,
+};
+
+enum struct MemberState : std::uint8_t {
+    ALIVE = 1,
+    SUSPECT = 2,
+    DEAD = 3,
+};
+
+struct MemberUpdate {
+    Client client;
+    MemberState state;
+    std::uint32_t incarnation;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & client;
+        ar & state;
+        ar & incarnation;
+    }
+};
+
+// GS
+struct Gossip {
+    GossipType gt;
+    std::uint32_t seq;
+    Client target;
+    std::vector<MemberUpdate> updates;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & gt;
+        ar & seq;
+        ar & target;
+        ar & updates;
+    }
+};
+
+// HB
+struct Heartbeat {
+    std::uint16_t bully_id;
+    std::uint32_t seq;
+    int current_song_id;
+    std::int32_t elapsed_ms;
+    bool paused;
+    std::uint16_t rank;
+    // Sent by whoever thinks it leads, the connector answers with a LEASE
+    bool wants_lease;
+    // Bully id of the successor a holder handed leadership off to, the lease goes there. 0 otherwise.
+    std::uint16_t hand_lease_to;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & bully_id;
+        ar & seq;
+        ar & current_song_id;
+        ar & elapsed_ms;
+        ar & paused;
+        ar & rank;
+        ar & wants_lease;
+        ar & hand_lease_to;
+    }
+};
+
+// RS
+struct ReplicaSync {
+    std::uint16_t replica_index;
+    std::uint32_t term;
+    bool primary;
+    // Primary sends its whole table when it changed, standbys send who heartbeated to them
+    bool full_table;
+    std::vector<Client> clients;
+    // A full table comes in parts, the standby installs it once it has all of the same table
+    std::uint64_t table_id = 0;
+    std::uint16_t part = 0;
+    std::uint16_t parts = 1;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & replica_index;
+        ar & term;
+        ar & primary;
+        ar & full_table;
+        ar & clients;
+        ar & table_id;
+        ar & part;
+        ar & parts;
+    }
+};
+
+// SU
+struct RegionSummary {
+    std::uint16_t region;
+    // Child connectors report upwards, parents answer with the path back down
+    bool downstream;
+    // Where the reporting connector accepts messages
+    std::uint16_t port;
+    std::uint32_t members;
+    // Best ranked listener in the subtree, only meaningful when members > 0
+    Client leader;
+    // Region leaders outside the subtree, the coordinator is among them
+    std::vector<Client> path;
+    // A path too long for one frame comes in parts, they can arrive in any order
+    std::uint32_t path_id = 0;
+    std::uint16_t part = 0;
+    std::uint16_t parts = 1;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & region;
+        ar & downstream;
+        ar & port;
+        ar & members;
+        ar & leader;
+        ar & path;
+        ar & path_id;
+        ar & part;
+        ar & parts;
+    }
+};
+
+// SB
+struct Subscribe {
+    // Where the subscriber left off, epoch 0 means it has nothing yet
+    std::uint32_t epoch;
+    std::uint64_t resume_from;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & epoch;
+        ar & resume_from;
+    }
+};
+
+// ME
+struct MembershipEvents {
+    // Sequence numbers only mean something within one connector run
+    std::uint32_t epoch;
+    // Sequence number of the last update in this frame, the updates are consecutive
+    std::uint64_t seq;
+    // Clients replaces whatever the subscriber had, updates apply on top of it
+    bool snapshot;
+    // The subscriber's own bully id, 0 until it has been admitted
+    std::uint16_t bully_id;
+    std::vector<Client> clients;
+    // ALIVE for joins, DEAD for leaves
+    std::vector<MemberUpdate> updates;
+    // A snapshot too big for one frame comes in parts, it only replaces anything once the last one is in
+    std::uint16_t part = 0;
+    std::uint16_t parts = 1;
+    // Upstream goes in frames of its own, split the same way. No parts means the frame doesn't touch it
+    std::vector<Client> upstream;
+    std::uint16_t upstream_part = 0;
+    std::uint16_t upstream_parts = 0;
 
     template<class Archive>
     void serialize(Archive& ar, const unsigned int version)
     {
+        ar & epoch;
+        ar & seq;
+        ar & snapshot;
+        ar & bully_id;
         ar & clients;
+        ar & updates;
+        ar & part;
+        ar & parts;
+        ar & upstream;
+        ar & upstream_part;
+        ar & upstream_parts;
+    }
+};
+
+// LS
+// The connector's answer to a lease request, also pushed to everyone when the holder changes
+struct Lease {
+    std::uint32_t epoch;
+    Client holder;
+    std::uint32_t duration_ms;
+    bool granted;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & epoch;
+        ar & holder;
+        ar & duration_ms;
+        ar & granted;
+    }
+};
+
+// TS
+// NTP style exchange with the leader, times are microseconds on each side's own steady clock
+struct TimeSync {
+    bool reply;
+    // Follower sent the request
+    std::int64_t t0;
+    // Leader got it and sent the reply
+    std::int64_t t1;
+    std::int64_t t2;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & reply;
+        ar & t0;
+        ar & t1;
+        ar & t2;
+    }
+};
+
+// PS
+// Where playback is on the room's timebase, followers work out their position from it
+struct PlaybackSchedule {
+    std::uint32_t lease_epoch;
+    int song_id;
+    bool paused;
+    // When the current song was at 0, only meaningful while playing
+    std::int64_t song_started_us;
+    // Where it was when this was sent
+    std::int32_t position_ms;
+    // The queue isn't in here, the digest says whether ours is the same
+    std::uint64_t digest;
+    // Counts every change to the queue, which one this is
+    std::uint64_t state_epoch;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & lease_epoch;
+        ar & song_id;
+        ar & paused;
+        ar & song_started_us;
+        ar & position_ms;
+        ar & digest;
+        ar & state_epoch;
+    }
+};
+
+// SD
+// Sent to the leader, which answers when its own digest differs: with the queue
+// items that changed since the state epoch we last synced to if it still has
+// them, otherwise the schedule while its whole queue follows as snapshots
+struct StateDigest {
+    std::uint32_t lease_epoch;
+    std::uint64_t digest;
+    std::uint64_t state_epoch;
+    std::uint64_t queue_digest;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & lease_epoch;
+        ar & digest;
+        ar & state_epoch;
+        ar & queue_digest;
+    }
+};
+
+// One song in the queue, the stamp and replica make it unique and put it in order
+struct QueueItem {
+    std::uint32_t stamp;
+    std::uint32_t replica;
+    int song_id;
+    bool removed;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & stamp;
+        ar & replica;
+        ar & song_id;
+        ar & removed;
+    }
+};
+
+// DL
+struct StateDelta {
+    std::uint32_t lease_epoch;
+    std::uint64_t from_epoch;
+    std::uint64_t state_epoch;
+    std::vector<QueueItem> items;
+    // What the queue hashes to once they are merged, when ours doesn't we have something they don't
+    std::uint64_t queue_digest;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & lease_epoch;
+        ar & from_epoch;
+        ar & state_epoch;
+        ar & items;
+        ar & queue_digest;
+    }
+};
+
+// One player command in the leader's log, applied in index order everywhere
+struct LogEntry {
+    // Lease epoch of the leader that appended it
+    std::uint32_t term;
+    std::uint64_t index;
+    ControlOperation op;
+    std::int64_t execute_at_us;
+    std::uint32_t origin;
+    std::uint32_t tag;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & term;
+        ar & index;
+        ar & op;
+        ar & execute_at_us;
+        ar & origin;
+        ar & tag;
+    }
+};
+
+// AE
+struct AppendEntries {
+    std::uint32_t term;
+    // The entry just before the first one here, followers that don't have it ask for what they missed
+    std::uint64_t prev_index;
+    std::uint32_t prev_term;
+    std::vector<LogEntry> entries;
+    // Too far behind for the log, take the full state and carry on from prev_index
+    bool reset;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & term;
+        ar & prev_index;
+        ar & prev_term;
+        ar & entries;
+        ar & reset;
+    }
+};
+
+// LF
+// Answered with an AppendEntries carrying what comes after from_index
+struct LogFetch {
+    std::uint32_t term;
+    std::uint64_t from_index;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & term;
+        ar & from_index;
+    }
+};
+
+// QD
+// Queue items to merge, a local enqueue goes out as one and a snapshot as a few of them
+struct QueueDelta {
+    std::vector<QueueItem> items;
+    // Set on a snapshot sent because the queues differ, the receiver sends its own back when it still has something we don't
+    bool ask_back;
+    std::uint64_t queue_digest;
+    // The sender's queue horizon, every item at or before this stamp and replica is gone
+    std::uint32_t horizon_stamp = 0;
+    std::uint32_t horizon_replica = 0;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version)
+    {
+        ar & items;
+        ar & ask_back;
+        ar & queue_digest;
+        ar & horizon_stamp;
+        ar & horizon_replica;
     }
 };
 
@@ -211,6 +663,48 @@ struct Message
             case MessageType::CONNECTOR_LIST_UPDATE:
                 new (&cu) ClientListUpdate;
                 break;
+            case MessageType::GOSSIP:
+                new (&gs) Gossip;
+                break;
+            case MessageType::HEARTBEAT:
+                new (&hb) Heartbeat;
+                break;
+            case MessageType::REPLICA_SYNC:
+                new (&rs) ReplicaSync;
+                break;
+            case MessageType::REGION_SUMMARY:
+                new (&su) RegionSummary;
+                break;
+            case MessageType::SUBSCRIBE:
+                new (&sb) Subscribe;
+                break;
+            case MessageType::MEMBERSHIP_EVENTS:
+                new (&me) MembershipEvents;
+                break;
+            case MessageType::LEASE:
+                new (&ls) Lease;
+                break;
+            case MessageType::TIME_SYNC:
+                new (&ts) TimeSync;
+                break;
+            case MessageType::PLAYBACK_SCHEDULE:
+                new (&ps) PlaybackSchedule;
+                break;
+            case MessageType::STATE_DIGEST:
+                new (&sd) StateDigest;
+                break;
+            case MessageType::STATE_DELTA:
+                new (&dl) StateDelta;
+                break;
+            case MessageType::APPEND_ENTRIES:
+                new (&ae) AppendEntries;
+                break;
+            case MessageType::LOG_FETCH:
+                new (&lf) LogFetch;
+                break;
+            case MessageType::QUEUE_DELTA:
+                new (&qd) QueueDelta;
+                break;
         }
     }
 
@@ -245,40 +739,125 @@ struct Message
             case MessageType::CONNECTOR_LIST_UPDATE:
                 cu.~ClientListUpdate();
                 break;
+            case MessageType::GOSSIP:
+                gs.~Gossip();
+                break;
+            case MessageType::HEARTBEAT:
+                hb.~Heartbeat();
+                break;
+            case MessageType::REPLICA_SYNC:
+                rs.~ReplicaSync();
+                break;
+            case MessageType::REGION_SUMMARY:
+                su.~RegionSummary();
+                break;
+            case MessageType::SUBSCRIBE:
+                sb.~Subscribe();
+                break;
+            case MessageType::MEMBERSHIP_EVENTS:
+                me.~MembershipEvents();
+                break;
+            case MessageType::LEASE:
+                ls.~Lease();
+                break;
+            case MessageType::TIME_SYNC:
+                ts.~TimeSync();
+                break;
+            case MessageType::PLAYBACK_SCHEDULE:
+                ps.~PlaybackSchedule();
+                break;
+            case MessageType::STATE_DIGEST:
+                sd.~StateDigest();
+                break;
+            case MessageType::STATE_DELTA:
+                dl.~StateDelta();
+                break;
+            case MessageType::APPEND_ENTRIES:
+                ae.~AppendEntries();
+                break;
+            case MessageType::LOG_FETCH:
+                lf.~LogFetch();
+                break;
+            case MessageType::QUEUE_DELTA:
+                qd.~QueueDelta();
+                break;
         }
         type.~MessageType();
     }
 
     Message(const Message& other) {
         type = other.type;
+        hlc = other.hlc;
         switch(type)
         {
             case MessageType::CONTROL_MUSIC:
-                cm = other.cm;
+                new (&cm) ControlMusic(other.cm);
                 break;
             case MessageType::CHANGE_SONG:
-                cs = other.cs;
+                new (&cs) ChangeSong(other.cs);
                 break;
             case MessageType::DISCONNECT:
-                dc = other.dc;
+                new (&dc) Disconnect(other.dc);
                 break;
             case MessageType::CONNECT:
-                cn = other.cn;
+                new (&cn) Connect(other.cn);
                 break;
             case MessageType::QUERY_STATUS:
-                qs = other.qs;
+                new (&qs) QueryStatus(other.qs);
                 break;
             case MessageType::SEND_STATUS:
-                ss = other.ss;
+                new (&ss) SendStatus(other.ss);
                 break;
             case MessageType::BULLY:
-                bl = other.bl;
+                new (&bl) Bully(other.bl);
                 break;
             case MessageType::CONNECTOR_LIST:
-                cl = other.cl;
+                new (&cl) ClientList(other.cl);
                 break;
             case MessageType::CONNECTOR_LIST_UPDATE:
-                cu = other.cu;
+                new (&cu) ClientListUpdate(other.cu);
+                break;
+            case MessageType::GOSSIP:
+                new (&gs) Gossip(other.gs);
+                break;
+            case MessageType::HEARTBEAT:
+                new (&hb) Heartbeat(other.hb);
+                break;
+            case MessageType::REPLICA_SYNC:
+                new (&rs) ReplicaSync(other.rs);
+                break;
+            case MessageType::REGION_SUMMARY:
+                new (&su) RegionSummary(other.su);
+                break;
+            case MessageType::SUBSCRIBE:
+                new (&sb) Subscribe(other.sb);
+                break;
+            case MessageType::MEMBERSHIP_EVENTS:
+                new (&me) MembershipEvents(other.me);
+                break;
+            case MessageType::LEASE:
+                new (&ls) Lease(other.ls);
+                break;
+            case MessageType::TIME_SYNC:
+                new (&ts) TimeSync(other.ts);
+                break;
+            case MessageType::PLAYBACK_SCHEDULE:
+                new (&ps) PlaybackSchedule(other.ps);
+                break;
+            case MessageType::STATE_DIGEST:
+                new (&sd) StateDigest(other.sd);
+                break;
+            case MessageType::STATE_DELTA:
+                new (&dl) StateDelta(other.dl);
+                break;
+            case MessageType::APPEND_ENTRIES:
+                new (&ae) AppendEntries(other.ae);
+                break;
+            case MessageType::LOG_FETCH:
+                new (&lf) LogFetch(other.lf);
+                break;
+            case MessageType::QUEUE_DELTA:
+                new (&qd) QueueDelta(other.qd);
                 break;
         }
     }
@@ -286,34 +865,77 @@ struct Message
     Message(Message&& other) noexcept // Move constructor
     {
         type = std::move(other.type);
+        hlc = other.hlc;
         switch(type)
         {
             case MessageType::CONTROL_MUSIC:
-                cm = std::move(other.cm);
+                new (&cm) ControlMusic(std::move(other.cm));
                 break;
             case MessageType::CHANGE_SONG:
-                cs = std::move(other.cs);
+                new (&cs) ChangeSong(std::move(other.cs));
                 break;
             case MessageType::DISCONNECT:
-                dc = std::move(other.dc);
+                new (&dc) Disconnect(std::move(other.dc));
                 break;
             case MessageType::CONNECT:
-                cn = std::move(other.cn);
+                new (&cn) Connect(std::move(other.cn));
                 break;
             case MessageType::QUERY_STATUS:
-                qs = std::move(other.qs);
+                new (&qs) QueryStatus(std::move(other.qs));
                 break;
             case MessageType::SEND_STATUS:
-                ss = std::move(other.ss);
+                new (&ss) SendStatus(std::move(other.ss));
                 break;
             case MessageType::BULLY:
-                bl = std::move(other.bl);
+                new (&bl) Bully(std::move(other.bl));
                 break;
             case MessageType::CONNECTOR_LIST:
-                cl = std::move(other.cl);
+                new (&cl) ClientList(std::move(other.cl));
                 break;
             case MessageType::CONNECTOR_LIST_UPDATE:
-                cu = std::move(other.cu);
+                new (&cu) ClientListUpdate(std::move(other.cu));
+                break;
+            case MessageType::GOSSIP:
+                new (&gs) Gossip(std::move(other.gs));
+                break;
+            case MessageType::HEARTBEAT:
+                new (&hb) Heartbeat(std::move(other.hb));
+                break;
+            case MessageType::REPLICA_SYNC:
+                new (&rs) ReplicaSync(std::move(other.rs));
+                break;
+            case MessageType::REGION_SUMMARY:
+                new (&su) RegionSummary(std::move(other.su));
+                break;
+            case MessageType::SUBSCRIBE:
+                new (&sb) Subscribe(std::move(other.sb));
+                break;
+            case MessageType::MEMBERSHIP_EVENTS:
+                new (&me) MembershipEvents(std::move(other.me));
+                break;
+            case MessageType::LEASE:
+                new (&ls) Lease(std::move(other.ls));
+                break;
+            case MessageType::TIME_SYNC:
+                new (&ts) TimeSync(std::move(other.ts));
+                break;
+            case MessageType::PLAYBACK_SCHEDULE:
+                new (&ps) PlaybackSchedule(std::move(other.ps));
+                break;
+            case MessageType::STATE_DIGEST:
+                new (&sd) StateDigest(std::move(other.sd));
+                break;
+            case MessageType::STATE_DELTA:
+                new (&dl) StateDelta(std::move(other.dl));
+                break;
+            case MessageType::APPEND_ENTRIES:
+                new (&ae) AppendEntries(std::move(other.ae));
+                break;
+            case MessageType::LOG_FETCH:
+                new (&lf) LogFetch(std::move(other.lf));
+                break;
+            case MessageType::QUEUE_DELTA:
+                new (&qd) QueueDelta(std::move(other.qd));
                 break;
         }
     } 
@@ -327,6 +949,10 @@ struct Message
     }
 
     MessageType type;
+    // Hybrid logical clock stamp from when the message was first sent, see hlc.hpp. The
+    // networking layer fills it in and relays keep it, so wherever the message ends up it
+    // orders the original event.
+    std::uint64_t hlc = 0;
 
     union 
     {
@@ -339,6 +965,20 @@ struct Message
         Bully            bl;
         ClientList       cl;
         ClientListUpdate cu;
+        Gossip           gs;
+        Heartbeat        hb;
+        ReplicaSync      rs;
+        RegionSummary    su;
+        Subscribe        sb;
+        MembershipEvents me;
+        Lease            ls;
+        TimeSync         ts;
+        PlaybackSchedule ps;
+        StateDigest      sd;
+        StateDelta       dl;
+        AppendEntries    ae;
+        LogFetch         lf;
+        QueueDelta       qd;
     };
 
     template<class Archive>
@@ -373,6 +1013,48 @@ struct Message
             case MessageType::CONNECTOR_LIST_UPDATE:
                 cu.serialize(ar, version);
                 break;
+            case MessageType::GOSSIP:
+                gs.serialize(ar, version);
+                break;
+            case MessageType::HEARTBEAT:
+                hb.serialize(ar, version);
+                break;
+            case MessageType::REPLICA_SYNC:
+                rs.serialize(ar, version);
+                break;
+            case MessageType::REGION_SUMMARY:
+                su.serialize(ar, version);
+                break;
+            case MessageType::SUBSCRIBE:
+                sb.serialize(ar, version);
+                break;
+            case MessageType::MEMBERSHIP_EVENTS:
+                me.serialize(ar, version);
+                break;
+            case MessageType::LEASE:
+                ls.serialize(ar, version);
+                break;
+            case MessageType::TIME_SYNC:
+                ts.serialize(ar, version);
+                break;
+            case MessageType::PLAYBACK_SCHEDULE:
+                ps.serialize(ar, version);
+                break;
+            case MessageType::STATE_DIGEST:
+                sd.serialize(ar, version);
+                break;
+            case MessageType::STATE_DELTA:
+                dl.serialize(ar, version);
+                break;
+            case MessageType::APPEND_ENTRIES:
+                ae.serialize(ar, version);
+                break;
+            case MessageType::LOG_FETCH:
+                lf.serialize(ar, version);
+                break;
+            case MessageType::QUEUE_DELTA:
+                qd.serialize(ar, version);
+                break;
         }
     }
 };
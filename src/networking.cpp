@@ -1,3 +1,4 @@
+#include "hlc.hpp"
 #include "message_types.hpp"
 #include "networking.hpp"
 
@@ -14,7 +15,11 @@
 #include <boost/exception/exception.hpp>
 #include <boost/exception/diagnostic_information.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -36,10 +41,13 @@ namespace hnoker
     using boost::asio::use_awaitable;
     namespace this_coro = boost::asio::this_coro;
 
-    awaitable<void> tcp_server_session(tcp::socket socket, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op);
+    awaitable<void> tcp_server_session(tcp::socket socket, const stream_op_t& stream_op);
     awaitable<void> tcp_client_session(tcp::socket socket, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op);
-    awaitable<void> accept_tcp_connections(const uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op);
+    awaitable<void> accept_tcp_connections(const uint16_t port, stream_op_t stream_op);
     awaitable<void> connect_to_tcp_server(const std::string_view host, const uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op);
+    awaitable<bool> send_frame_to_tcp_server(std::string host, uint16_t port, frame_ptr frame, std::chrono::milliseconds deadline);
+    awaitable<bool> request_from_tcp_server(std::string host, uint16_t port, request_builder request, std::span<char> read_buf, std::chrono::milliseconds deadline);
+    awaitable<void> stream_to_tcp_server(std::string host, uint16_t port, std::span<char> write_buf, frame_producer producer, std::chrono::milliseconds interval, std::span<char> read_buf, frame_consumer consumer);
 
     struct network_context 
     {
@@ -50,6 +58,122 @@ namespace hnoker
         io_context boost_ctx;
     };
 
+    class tcp_stream_channel : public stream_channel, public std::enable_shared_from_this<tcp_stream_channel>
+    {
+    public:
+        explicit tcp_stream_channel(std::shared_ptr<tcp::socket> socket) :
+            socket(std::move(socket))
+        {}
+
+        void send(frame_ptr frame) override
+        {
+            if (!open)
+                return;
+            boost::asio::post(socket->get_executor(), [self = shared_from_this(), frame = std::move(frame)]() mutable
+            {
+                if (!self->open)
+                    return;
+                self->queue.push_back(std::move(frame));
+                if (self->queue.size() == 1)
+                    self->write_next();
+            });
+        }
+
+        bool is_open() const override
+        {
+            return open;
+        }
+
+        void close()
+        {
+            open = false;
+        }
+
+    private:
+        // Only runs on the socket's executor
+        void write_next()
+        {
+            boost::asio::async_write(*socket, boost::asio::buffer(*queue.front()), [self = shared_from_this()](const boost::system::error_code& ec, std::size_t)
+            {
+                if (ec)
+                {
+                    self->open = false;
+                    self->queue.clear();
+                    return;
+                }
+                self->queue.pop_front();
+                if (self->open && !self->queue.empty())
+                    self->write_next();
+            });
+        }
+
+        std::shared_ptr<tcp::socket> socket;
+        std::atomic_bool open{true};
+        std::deque<frame_ptr> queue;
+    };
+
+    struct socket_closer
+    {
+        std::shared_ptr<tcp::socket> socket;
+
+        ~socket_closer()
+        {
+            boost::system::error_code ec;
+            socket->close(ec);
+        }
+    };
+
+    std::optional<endpoint> parse_endpoint(std::string_view text, std::uint16_t default_port)
+    {
+        if (text.empty())
+            return std::nullopt;
+
+        auto colon = text.rfind(':');
+        if (colon == std::string_view::npos)
+            return endpoint{std::string(text), default_port};
+
+        try
+        {
+            int port = std::stoi(std::string(text.substr(colon + 1)));
+            if (port <= 0 || port > 65535)
+                return std::nullopt;
+            return endpoint{std::string(text.substr(0, colon)), static_cast<std::uint16_t>(port)};
+        }
+        catch (const std::exception&)
+        {
+            return std::nullopt;
+        }
+    }
+
+    endpoint_set::endpoint_set(std::vector<endpoint> endpoints) :
+        endpoints(std::move(endpoints))
+    {
+        if (this->endpoints.empty())
+            throw std::runtime_error("endpoint_set needs at least one endpoint");
+    }
+
+    endpoint endpoint_set::current() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return endpoints[index];
+    }
+
+    void endpoint_set::failed(const endpoint& ep)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (endpoints[index] == ep)
+        {
+            index = (index + 1) % endpoints.size();
+            INFO("Giving up on {}:{}, switching to {}:{}", ep.ip, ep.port, endpoints[index].ip, endpoints[index].port);
+        }
+    }
+
+    std::size_t endpoint_set::size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return endpoints.size();
+    }
+
     network_context* allocate_network_context()
     {
         return new network_context;
@@ -65,6 +189,22 @@ namespace hnoker
         ctx->boost_ctx.run();
     }
 
+    void run_until_stopped_impl(network_context* ctx)
+    {
+        auto work = boost::asio::make_work_guard(ctx->boost_ctx);
+        ctx->boost_ctx.run();
+    }
+
+    void stop_impl(network_context* ctx)
+    {
+        ctx->boost_ctx.stop();
+    }
+
+    void post_impl(network_context* ctx, std::function<void()> fn)
+    {
+        boost::asio::post(ctx->boost_ctx, std::move(fn));
+    }
+
     static void handle_network_eptr(std::exception_ptr eptr, const timeout_handler& eh)
     {
         try
@@ -88,9 +228,20 @@ namespace hnoker
         }
     }
 
-    void async_create_server_impl(network_context* ctx, uint16_t port, std::span<char> read_buf, std::span<char> write_buf,  const read_write_op_t& read_write_op, const timeout_handler& eh)
+    void async_create_server_impl(network_context* ctx, uint16_t port, const read_write_op_t& read_write_op, const timeout_handler& eh)
     {
-        co_spawn(ctx->boost_ctx, accept_tcp_connections(port, read_buf, write_buf, read_write_op), [eh](std::exception_ptr ep) {
+        stream_op_t op = [&read_write_op](std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port, const channel_ptr&) -> bool
+        {
+            return read_write_op(read_buf, write_buf, ip, port);
+        };
+        co_spawn(ctx->boost_ctx, accept_tcp_connections(port, std::move(op)), [eh](std::exception_ptr ep) {
+            handle_network_eptr(ep, eh);
+        });
+    }
+
+    void async_create_stream_server_impl(network_context* ctx, uint16_t port, stream_op_t stream_op, const timeout_handler& eh)
+    {
+        co_spawn(ctx->boost_ctx, accept_tcp_connections(port, std::move(stream_op)), [eh](std::exception_ptr ep) {
             handle_network_eptr(ep, eh);
         });
     }
@@ -102,17 +253,60 @@ namespace hnoker
         });
     }
 
-    void write_message_to_buffer(std::span<char> buffer, const Message& m)
+    void async_send_frame_impl(network_context* ctx, std::string_view address, uint16_t port, frame_ptr frame, std::chrono::milliseconds deadline, send_completion done)
+    {
+        co_spawn(ctx->boost_ctx, send_frame_to_tcp_server(std::string(address), port, std::move(frame), deadline), [done = std::move(done)](std::exception_ptr ep, bool delivered) {
+            if (ep)
+                delivered = false;
+            if (done)
+                done(delivered);
+        });
+    }
+
+    void async_request_impl(network_context* ctx, std::string_view address, uint16_t port, request_builder request, std::span<char> read_buf, std::chrono::milliseconds deadline, reply_handler done)
+    {
+        co_spawn(ctx->boost_ctx, request_from_tcp_server(std::string(address), port, std::move(request), read_buf, deadline), [done = std::move(done)](std::exception_ptr ep, bool answered) {
+            if (ep)
+                answered = false;
+            if (done)
+                done(answered);
+        });
+    }
+
+    void async_stream_to_server_impl(network_context* ctx, std::string_view address, uint16_t port, std::span<char> write_buf, frame_producer producer, std::chrono::milliseconds interval, stream_closed_handler on_closed, std::span<char> read_buf, frame_consumer consumer)
+    {
+        co_spawn(ctx->boost_ctx, stream_to_tcp_server(std::string(address), port, write_buf, std::move(producer), interval, read_buf, std::move(consumer)), [on_closed = std::move(on_closed)](std::exception_ptr ep) {
+            handle_network_eptr(ep, default_timeout_handler);
+            on_closed();
+        });
+    }
+
+    static void write_hlc(std::span<char> buffer, hlc_timestamp stamp)
+    {
+        for (std::size_t i = 0; i < 8; i++)
+            buffer[3 + i] = static_cast<char>(stamp >> (8 * i));
+    }
+
+    static hlc_timestamp read_hlc(std::span<const char> buffer)
+    {
+        hlc_timestamp stamp = 0;
+        for (std::size_t i = 0; i < 8; i++)
+            stamp |= static_cast<hlc_timestamp>(static_cast<std::uint8_t>(buffer[3 + i])) << (8 * i);
+        return stamp;
+    }
+
+    std::size_t write_message_to_buffer(std::span<char> buffer, const Message& m)
     {
         INFO("Writing message from buffer, type as integer is {}", +(static_cast<char>(m.type)));
         buffer[0] = static_cast<char>(m.type);
+        write_hlc(buffer, m.hlc != 0 ? m.hlc : process_clock().now());
 
-        std::span<char> archive_buffer{buffer.begin() + 1, buffer.end()};
+        std::span<char> archive_buffer{buffer.begin() + FRAME_HEADER_SIZE, buffer.end()};
         std::ostrstream output_stream(archive_buffer.data(), (int) archive_buffer.size());
 
-        boost::archive::text_oarchive oa{output_stream};
         try
         {
+            boost::archive::text_oarchive oa{output_stream};
             oa << m;
         }
         catch (std::exception& e)
@@ -120,12 +314,42 @@ namespace hnoker
             INFO("Archiving busted, pls fix");
             throw std::runtime_error("archiving bad and busted");
         }
+
+        if (output_stream.fail())
+            throw std::runtime_error("message does not fit in the buffer");
+
+        const auto length = static_cast<std::uint16_t>(output_stream.pcount());
+        buffer[1] = static_cast<char>(length & 0xff);
+        buffer[2] = static_cast<char>(length >> 8);
+        return FRAME_HEADER_SIZE + length;
+    }
+
+    frame_ptr make_frame(const Message& m)
+    {
+        std::vector<char> buffer(FRAME_BUFFER_SIZE);
+        buffer.resize(write_message_to_buffer(buffer, m));
+        return std::make_shared<const std::vector<char>>(std::move(buffer));
+    }
+
+    static std::size_t payload_size(std::span<const char> buffer)
+    {
+        return static_cast<std::uint8_t>(buffer[1]) | (static_cast<std::uint8_t>(buffer[2]) << 8);
+    }
+
+    std::size_t frame_size(std::span<const char> buffer)
+    {
+        if (buffer.size() < FRAME_HEADER_SIZE)
+            return buffer.size();
+        return std::min(buffer.size(), FRAME_HEADER_SIZE + payload_size(buffer));
     }
 
     Message read_message_from_buffer(const std::span<char>& buffer)
     {
         Message m { static_cast<MessageType>(buffer[0]) };
-        std::istrstream input_stream(buffer.data() + 1, (int) buffer.size() - 1);
+        m.hlc = read_hlc(buffer);
+        if (m.hlc != 0)
+            process_clock().observe(m.hlc);
+        std::istrstream input_stream(buffer.data() + FRAME_HEADER_SIZE, (int) (frame_size(buffer) - FRAME_HEADER_SIZE));
         boost::archive::text_iarchive ia{input_stream};
         try
         {
@@ -139,29 +363,54 @@ namespace hnoker
         return m;
     }
 
-    awaitable<void> tcp_server_session(tcp::socket socket, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op)
+    // Reads one whole frame into read_buf, returns its size or 0 if it doesn't fit
+    static awaitable<std::size_t> read_frame(tcp::socket& socket, std::span<char> read_buf)
+    {
+        co_await boost::asio::async_read(socket, boost::asio::buffer(read_buf, FRAME_HEADER_SIZE), use_awaitable);
+        std::size_t n = payload_size(read_buf);
+        if (FRAME_HEADER_SIZE + n > read_buf.size())
+            co_return 0;
+        co_await boost::asio::async_read(socket, boost::asio::buffer(read_buf.subspan(FRAME_HEADER_SIZE), n), use_awaitable);
+        co_return FRAME_HEADER_SIZE + n;
+    }
+
+    awaitable<void> tcp_server_session(tcp::socket s, const stream_op_t& stream_op)
     {
+        // Frames are read in two steps, with one buffer per server a second connection would write into a half read frame
+        std::array<char, FRAME_BUFFER_SIZE> read_buf;
+        std::array<char, FRAME_BUFFER_SIZE> write_buf;
+        auto socket = std::make_shared<tcp::socket>(std::move(s));
+        auto channel = std::make_shared<tcp_stream_channel>(socket);
         try
         {
-            auto ip = socket.remote_endpoint().address();
-            auto port = socket.remote_endpoint().port();
+            auto ip = socket->remote_endpoint().address();
+            auto port = socket->remote_endpoint().port();
 
             for (;;)
             {
                 INFO("Starting tcp server session for client connecting from {}:{}", ip.to_string(), port);
-                std::size_t n = co_await socket.async_read_some(boost::asio::buffer(read_buf), use_awaitable);
+                std::size_t n = co_await read_frame(*socket, read_buf);
+                if (n == 0)
+                {
+                    INFO("Frame from {} does not fit in the read buffer, dropping connection", ip.to_string());
+                    channel->close();
+                    co_return;
+                }
                 INFO("Server received {} bytes", n);
-                bool send_response = read_write_op(read_buf, write_buf, ip.to_string(), (std::uint16_t) port);
+                bool send_response = stream_op(read_buf, write_buf, ip.to_string(), (std::uint16_t) port, channel);
                 if (send_response)
                 {
-                    co_await async_write(socket, boost::asio::buffer(write_buf), use_awaitable);
-                    INFO("Server responded with {} bytes", write_buf.size());
+                    std::size_t response_size = frame_size(write_buf);
+                    co_await async_write(*socket, boost::asio::buffer(write_buf, response_size), use_awaitable);
+                    INFO("Server responded with {} bytes", response_size);
                 }
             }
         }
         catch (boost::system::system_error& e)
         {
-            auto ip = socket.remote_endpoint().address();
+            channel->close();
+            boost::system::error_code ec;
+            auto ip = socket->remote_endpoint(ec).address();
 
             if (e.code() == boost::asio::error::eof)
             {
@@ -183,7 +432,7 @@ namespace hnoker
             auto port = socket.remote_endpoint().port();
             INFO("Tcp client open to {}:{}", ip.to_string(), port);
             read_write_op(read_buf, write_buf, ip.to_string(), (std::uint16_t) port);
-            co_await async_write(socket, boost::asio::buffer(write_buf), use_awaitable);
+            co_await async_write(socket, boost::asio::buffer(write_buf, frame_size(write_buf)), use_awaitable);
         }
         catch (boost::system::system_error& e)
         {
@@ -200,7 +449,7 @@ namespace hnoker
         }
     }
 
-    awaitable<void> accept_tcp_connections(const uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op)
+    awaitable<void> accept_tcp_connections(const uint16_t port, stream_op_t stream_op)
     {
         auto executor = co_await this_coro::executor;
         tcp::acceptor acceptor(executor, {tcp::v4(), port});
@@ -214,7 +463,7 @@ namespace hnoker
             socket.set_option(option);
 
             INFO("Client connecting from {}", ip.to_string(), port);
-            co_spawn(executor, tcp_server_session(std::move(socket), read_buf, write_buf, read_write_op), detached);
+            co_spawn(executor, tcp_server_session(std::move(socket), stream_op), detached);
         }
     }
 
@@ -242,4 +491,116 @@ namespace hnoker
 
         co_await tcp_client_session(std::move(socket), read_buf, write_buf, read_write_op);
     }
+
+    awaitable<bool> send_frame_to_tcp_server(std::string host, uint16_t port, frame_ptr frame, std::chrono::milliseconds deadline)
+    {
+        auto executor = co_await this_coro::executor;
+        tcp::socket socket(executor);
+        tcp::endpoint endpoint(address::from_string(host), port);
+
+        boost::asio::steady_timer timer(executor);
+        timer.expires_after(deadline);
+        timer.async_wait([&socket](const boost::system::error_code& ec)
+        {
+            if (!ec)
+                socket.close();
+        });
+
+        try
+        {
+            co_await socket.async_connect(endpoint, use_awaitable);
+            co_await async_write(socket, boost::asio::buffer(*frame), use_awaitable);
+        }
+        catch (const boost::system::system_error& e)
+        {
+            INFO("Sending to {}:{} failed: {}", host, port, e.what());
+            co_return false;
+        }
+
+        timer.cancel();
+        co_return true;
+    }
+
+    awaitable<bool> request_from_tcp_server(std::string host, uint16_t port, request_builder request, std::span<char> read_buf, std::chrono::milliseconds deadline)
+    {
+        auto executor = co_await this_coro::executor;
+        tcp::socket socket(executor);
+        tcp::endpoint endpoint(address::from_string(host), port);
+
+        boost::asio::steady_timer timer(executor);
+        timer.expires_after(deadline);
+        timer.async_wait([&socket](const boost::system::error_code& ec)
+        {
+            if (!ec)
+                socket.close();
+        });
+
+        std::size_t n = 0;
+        try
+        {
+            co_await socket.async_connect(endpoint, use_awaitable);
+            frame_ptr frame = request();
+            co_await async_write(socket, boost::asio::buffer(*frame), use_awaitable);
+            n = co_await read_frame(socket, read_buf);
+        }
+        catch (const boost::system::system_error& e)
+        {
+            INFO("Request to {}:{} failed: {}", host, port, e.what());
+            co_return false;
+        }
+
+        timer.cancel();
+        co_return n > 0;
+    }
+
+    static awaitable<void> read_stream_frames(std::shared_ptr<tcp::socket> socket, std::span<char> read_buf, frame_consumer consumer)
+    {
+        socket_closer closer{socket};
+        try
+        {
+            while (co_await read_frame(*socket, read_buf) > 0)
+                consumer(read_buf);
+            INFO("Frame pushed by the server does not fit in the read buffer, closing stream");
+        }
+        catch (const boost::system::system_error& e)
+        {
+            // The writer side notices the closed socket and reports the stream as closed
+        }
+    }
+
+    awaitable<void> stream_to_tcp_server(std::string host, uint16_t port, std::span<char> write_buf, frame_producer producer, std::chrono::milliseconds interval, std::span<char> read_buf, frame_consumer consumer)
+    {
+        auto executor = co_await this_coro::executor;
+        auto socket = std::make_shared<tcp::socket>(executor);
+        tcp::endpoint endpoint(address::from_string(host), port);
+        socket_closer closer{socket};
+
+        boost::asio::steady_timer timer(executor);
+        timer.expires_after(std::chrono::seconds(1));
+        timer.async_wait([socket](const boost::system::error_code& ec)
+        {
+            if (!ec)
+                socket->close();
+        });
+
+        INFO("Opening stream to server {}:{}", host, port);
+        co_await socket->async_connect(endpoint, use_awaitable);
+        timer.cancel();
+
+        socket_base::keep_alive option(true);
+        socket->set_option(option);
+
+        if (consumer)
+            co_spawn(executor, read_stream_frames(socket, read_buf, std::move(consumer)), detached);
+
+        while (producer(write_buf))
+        {
+            co_await async_write(*socket, boost::asio::buffer(write_buf, frame_size(write_buf)), use_awaitable);
+            timer.expires_after(interval);
+            co_await timer.async_wait(use_awaitable);
+            if (!socket->is_open())
+                break;
+        }
+        INFO("Stream to {}:{} finished", host, port);
+    }
 }
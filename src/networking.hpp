@@ -1,13 +1,25 @@
 #pragma once
 
 #include "logging.hpp"
+#include "message_types.hpp"
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <span>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #define LISTENER_SERVER_PORT 43210
 #define CONNECTOR_SERVER_PORT 1738
+#define HEARTBEAT_INTERVAL_MS 500
+
+// Frames are [type][u16 payload length][u64 hlc][payload], so several can share a connection
+#define FRAME_HEADER_SIZE 11
+// No frame is bigger than this, every connection a server accepts gets buffers of this size
+#define FRAME_BUFFER_SIZE 1024
 
 namespace hnoker 
 {
@@ -15,20 +27,81 @@ namespace hnoker
 
     using read_write_op_t = std::function<bool(std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port)>;
     using timeout_handler = std::function<void()>;
+    using frame_producer = std::function<bool(std::span<char> write_buf)>;
+    using stream_closed_handler = std::function<void()>;
+    using send_completion = std::function<void(bool delivered)>;
+    using frame_ptr = std::shared_ptr<const std::vector<char>>;
+    using frame_consumer = std::function<void(std::span<char> read_buf)>;
+    using reply_handler = std::function<void(bool answered)>;
+    using request_builder = std::function<frame_ptr()>;
+
+    // The server side of a connection the peer keeps open, frames can be pushed
+    // back to the peer over it at any time. Don't mix with responses from the
+    // read_write_op on the same connection.
+    class stream_channel
+    {
+    public:
+        virtual ~stream_channel() = default;
+        // Queued and written in order, safe to call from any thread
+        virtual void send(frame_ptr frame) = 0;
+        virtual bool is_open() const = 0;
+    };
+
+    using channel_ptr = std::shared_ptr<stream_channel>;
+    using stream_op_t = std::function<bool(std::span<char> read_buf, std::span<char> write_buf, const std::string& ip, std::uint16_t port, const channel_ptr& channel)>;
 
     const static timeout_handler default_timeout_handler = []() {
         INFO("default timeout handler called!");
     };
 
+    struct endpoint
+    {
+        std::string ip;
+        std::uint16_t port;
+
+        bool operator==(const endpoint& rhs) const = default;
+    };
+
+    // Accepts "ip" or "ip:port"
+    std::optional<endpoint> parse_endpoint(std::string_view text, std::uint16_t default_port);
+
+    // Ordered list of interchangeable servers, sticks with one until it fails
+    class endpoint_set
+    {
+    public:
+        explicit endpoint_set(std::vector<endpoint> endpoints);
+
+        endpoint current() const;
+        // Moves on to the next endpoint, unless someone already moved on from this one
+        void failed(const endpoint& ep);
+        std::size_t size() const;
+
+    private:
+        mutable std::mutex mutex;
+        std::vector<endpoint> endpoints;
+        std::size_t index = 0;
+    };
+
     network_context* allocate_network_context();
     void deallocate_network_context(network_context* network_context);
     void run_impl(network_context* network_context);
+    void run_until_stopped_impl(network_context* network_context);
+    void stop_impl(network_context* network_context);
+    void post_impl(network_context* network_context, std::function<void()> fn);
 
-    void async_create_server_impl(network_context* ctx, uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op, const timeout_handler& eh);
+    void async_create_server_impl(network_context* ctx, uint16_t port, const read_write_op_t& read_write_op, const timeout_handler& eh);
+    void async_create_stream_server_impl(network_context* ctx, uint16_t port, stream_op_t stream_op, const timeout_handler& eh);
     void async_connect_server_impl(network_context* ctx, std::string_view address, uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op, const timeout_handler& eh);
+    void async_send_frame_impl(network_context* ctx, std::string_view address, uint16_t port, frame_ptr frame, std::chrono::milliseconds deadline, send_completion done);
+    void async_stream_to_server_impl(network_context* ctx, std::string_view address, uint16_t port, std::span<char> write_buf, frame_producer producer, std::chrono::milliseconds interval, stream_closed_handler on_closed, std::span<char> read_buf, frame_consumer consumer);
+    void async_request_impl(network_context* ctx, std::string_view address, uint16_t port, request_builder request, std::span<char> read_buf, std::chrono::milliseconds deadline, reply_handler done);
 
-    void write_message_to_buffer(std::span<char> buffer, const Message& m);
+    // A message without a stamp gets one from process_clock(), a relayed one keeps the one it came with
+    std::size_t write_message_to_buffer(std::span<char> buffer, const Message& m);
+    // process_clock() moves past the stamp of every message read
     Message read_message_from_buffer(const std::span<char>& buffer);
+    std::size_t frame_size(std::span<const char> buffer);
+    frame_ptr make_frame(const Message& m);
 
     struct network
     {
@@ -41,9 +114,16 @@ namespace hnoker
             deallocate_network_context(ctx);
         }
 
-        void async_create_server(uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op, const timeout_handler& eh)
+        // Each connection reads and answers in buffers of its own, so they can't overwrite each other's frames
+        void async_create_server(uint16_t port, const read_write_op_t& read_write_op, const timeout_handler& eh)
+        {
+            async_create_server_impl(ctx, port, read_write_op, eh);
+        }
+
+        // Same as async_create_server, but the op also gets a channel for pushing frames back later
+        void async_create_stream_server(uint16_t port, stream_op_t stream_op, const timeout_handler& eh)
         {
-            async_create_server_impl(ctx, port, read_buf, write_buf, read_write_op, eh);
+            async_create_stream_server_impl(ctx, port, std::move(stream_op), eh);
         }
 
         void async_connect_server(std::string_view address, uint16_t port, std::span<char> read_buf, std::span<char> write_buf, const read_write_op_t& read_write_op, const timeout_handler& eh)
@@ -51,11 +131,50 @@ namespace hnoker
             async_connect_server_impl(ctx, address, port, read_buf, write_buf, read_write_op, eh);
         }
 
+        // Keeps one connection open and writes a frame from the producer every interval,
+        // until the producer returns false or the connection breaks. Frames the server
+        // pushes back are handed to the consumer, if there is one.
+        void async_stream_to_server(std::string_view address, uint16_t port, std::span<char> write_buf, frame_producer producer, std::chrono::milliseconds interval, stream_closed_handler on_closed, std::span<char> read_buf = {}, frame_consumer consumer = {})
+        {
+            async_stream_to_server_impl(ctx, address, port, write_buf, std::move(producer), interval, std::move(on_closed), read_buf, std::move(consumer));
+        }
+
+        // Sends an already serialized frame, the frame can be shared between many sends.
+        // The deadline covers both connecting and writing.
+        void async_send_frame(std::string_view address, uint16_t port, frame_ptr frame, std::chrono::milliseconds deadline, send_completion done)
+        {
+            async_send_frame_impl(ctx, address, port, std::move(frame), deadline, std::move(done));
+        }
+
+        // Sends a frame and waits for the server to answer with one frame on the same
+        // connection, the answer is left in read_buf. The request is only built once
+        // connected, so times taken in it don't include the connect. The deadline covers it all.
+        void async_request(std::string_view address, uint16_t port, request_builder request, std::span<char> read_buf, std::chrono::milliseconds deadline, reply_handler done)
+        {
+            async_request_impl(ctx, address, port, std::move(request), read_buf, deadline, std::move(done));
+        }
+
         void run()
         {
             run_impl(ctx);
         }
 
+        // Like run but doesn't return when out of work, only after stop()
+        void run_until_stopped()
+        {
+            run_until_stopped_impl(ctx);
+        }
+
+        void stop()
+        {
+            stop_impl(ctx);
+        }
+
+        void post(std::function<void()> fn)
+        {
+            post_impl(ctx, std::move(fn));
+        }
+
     private:
         network_context* ctx;
     };
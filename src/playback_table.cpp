@@ -0,0 +1,252 @@
+#include "playback_table.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+namespace hnoker
+{
+    static constexpr std::size_t no_row = std::numeric_limits<std::size_t>::max();
+
+    static std::int64_t to_ms(playback_table::clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+    }
+
+    void playback_table::update(const std::string& member_ip, std::uint16_t member_rank, std::uint16_t member_id, int member_song, std::int32_t member_elapsed_ms, bool member_paused, clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::size_t row;
+        auto it = row_of.find(member_ip);
+        if (it != row_of.end())
+        {
+            row = it->second;
+            unindex(row);
+        }
+        else
+        {
+            row = ip.size();
+            ip.push_back(member_ip);
+            rank.push_back(0);
+            bully_id.push_back(0);
+            song.push_back(0);
+            elapsed_ms.push_back(0);
+            started_ms.push_back(0);
+            paused.push_back(0);
+            row_of[member_ip] = row;
+        }
+
+        // Heartbeats before the CONNECTOR_LIST arrived carry id 0, keep what we knew
+        if (member_id != 0)
+            bully_id[row] = member_id;
+        rank[row] = member_rank;
+        song[row] = member_song;
+        elapsed_ms[row] = member_elapsed_ms;
+        started_ms[row] = to_ms(now) - member_elapsed_ms;
+        paused[row] = member_paused;
+        index(row);
+    }
+
+    void playback_table::remove(const std::string& member_ip)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = row_of.find(member_ip);
+        if (it == row_of.end())
+            return;
+
+        const std::size_t row = it->second;
+        const std::size_t last = ip.size() - 1;
+        unindex(row);
+        row_of.erase(it);
+
+        // Move the last row into the hole, the indexes go by ip so only row_of changes
+        if (row != last)
+        {
+            ip[row] = std::move(ip[last]);
+            rank[row] = rank[last];
+            bully_id[row] = bully_id[last];
+            song[row] = song[last];
+            elapsed_ms[row] = elapsed_ms[last];
+            started_ms[row] = started_ms[last];
+            paused[row] = paused[last];
+            row_of[ip[row]] = row;
+        }
+        ip.pop_back();
+        rank.pop_back();
+        bully_id.pop_back();
+        song.pop_back();
+        elapsed_ms.pop_back();
+        started_ms.pop_back();
+        paused.pop_back();
+    }
+
+    void playback_table::index(std::size_t row)
+    {
+        if (bully_id[row] != 0)
+            by_rank[{ rank[row], bully_id[row] }] = ip[row];
+        song_members[song[row]]++;
+
+        if (paused[row])
+        {
+            paused_on[song[row]].insert(ip[row]);
+            paused_count++;
+        }
+        else
+        {
+            playing[song[row]].emplace(started_ms[row], ip[row]);
+        }
+    }
+
+    void playback_table::unindex(std::size_t row)
+    {
+        auto id = by_rank.find({ rank[row], bully_id[row] });
+        if (id != by_rank.end() && id->second == ip[row])
+            by_rank.erase(id);
+
+        if (--song_members[song[row]] == 0)
+            song_members.erase(song[row]);
+
+        if (paused[row])
+        {
+            auto& on_song = paused_on[song[row]];
+            on_song.erase(ip[row]);
+            if (on_song.empty())
+                paused_on.erase(song[row]);
+            paused_count--;
+            return;
+        }
+
+        auto& on_song = playing[song[row]];
+        auto [first, last] = on_song.equal_range(started_ms[row]);
+        for (auto it = first; it != last; ++it)
+        {
+            if (it->second == ip[row])
+            {
+                on_song.erase(it);
+                break;
+            }
+        }
+        if (on_song.empty())
+            playing.erase(song[row]);
+    }
+
+    std::size_t playback_table::leader_row() const
+    {
+        if (by_rank.empty())
+            return no_row;
+        return row_of.at(by_rank.rbegin()->second);
+    }
+
+    std::size_t playback_table::members_on_locked(int s) const
+    {
+        auto it = song_members.find(s);
+        return it == song_members.end() ? 0 : it->second;
+    }
+
+    std::size_t playback_table::members_on(int s) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return members_on_locked(s);
+    }
+
+    std::vector<std::pair<int, std::size_t>> playback_table::songs() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {song_members.begin(), song_members.end()};
+    }
+
+    std::chrono::milliseconds playback_table::max_drift_locked() const
+    {
+        const std::size_t leader = leader_row();
+        if (leader == no_row || paused[leader])
+            return std::chrono::milliseconds(0);
+
+        // The leader is in this index itself, so it is never empty
+        const start_index& on_song = playing.at(song[leader]);
+        const std::int64_t ahead = started_ms[leader] - on_song.begin()->first;
+        const std::int64_t behind = on_song.rbegin()->first - started_ms[leader];
+        return std::chrono::milliseconds(std::max(ahead, behind));
+    }
+
+    std::chrono::milliseconds playback_table::max_drift() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return max_drift_locked();
+    }
+
+    std::vector<std::string> playback_table::desynced(std::chrono::milliseconds tolerance) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> out;
+
+        const std::size_t leader = leader_row();
+        if (leader == no_row)
+            return out;
+        const int leader_song = song[leader];
+
+        // Everyone on another song is out of sync, whatever their offset
+        for (const auto& [s, on_song] : playing)
+        {
+            if (s != leader_song)
+                for (const auto& [start, member] : on_song)
+                    out.push_back(member);
+        }
+        for (const auto& [s, on_song] : paused_on)
+        {
+            if (s != leader_song)
+                out.insert(out.end(), on_song.begin(), on_song.end());
+        }
+
+        auto same_song_playing = playing.find(leader_song);
+        auto same_song_paused = paused_on.find(leader_song);
+
+        if (paused[leader])
+        {
+            if (same_song_playing != playing.end())
+                for (const auto& [start, member] : same_song_playing->second)
+                    out.push_back(member);
+            if (same_song_paused != paused_on.end())
+            {
+                for (const std::string& member : same_song_paused->second)
+                {
+                    if (std::abs(elapsed_ms[row_of.at(member)] - elapsed_ms[leader]) > tolerance.count())
+                        out.push_back(member);
+                }
+            }
+            return out;
+        }
+
+        if (same_song_paused != paused_on.end())
+            out.insert(out.end(), same_song_paused->second.begin(), same_song_paused->second.end());
+
+        // Only walk in from both ends until we are within tolerance
+        const start_index& on_song = same_song_playing->second;
+        const std::int64_t low = started_ms[leader] - tolerance.count();
+        const std::int64_t high = started_ms[leader] + tolerance.count();
+        for (auto it = on_song.begin(); it != on_song.end() && it->first < low; ++it)
+            out.push_back(it->second);
+        for (auto it = on_song.rbegin(); it != on_song.rend() && it->first > high; ++it)
+            out.push_back(it->second);
+        return out;
+    }
+
+    room_health playback_table::health() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        room_health h;
+        h.members = ip.size();
+        h.paused = paused_count;
+        h.songs = song_members.size();
+
+        const std::size_t leader = leader_row();
+        if (leader != no_row)
+        {
+            h.leader_song = song[leader];
+            h.on_leader_song = members_on_locked(song[leader]);
+            h.max_drift = max_drift_locked();
+        }
+        return h;
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace hnoker
+{
+    struct room_health
+    {
+        std::size_t members = 0;
+        std::size_t paused = 0;
+        std::size_t songs = 0;
+        // What the leader (best rank, bully id breaks ties) is playing, -1 if nobody has reported
+        int leader_song = -1;
+        std::size_t on_leader_song = 0;
+        std::chrono::milliseconds max_drift{0};
+    };
+
+    // Latest playback report of every member, one column per field. Next to the
+    // rows it keeps members indexed by song and by when their song started
+    // (arrival time minus elapsed, in connector time), so counts and drift are
+    // read straight off the indexes instead of scanning every member.
+    class playback_table
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        void update(const std::string& ip, std::uint16_t rank, std::uint16_t bully_id, int song, std::int32_t elapsed_ms, bool paused, clock::time_point now);
+        void remove(const std::string& ip);
+
+        std::size_t members_on(int song) const;
+        // Song id and how many are playing it
+        std::vector<std::pair<int, std::size_t>> songs() const;
+        // Furthest any playing member on the leader's song is from the leader
+        std::chrono::milliseconds max_drift() const;
+        // Members on another song, paused differently, or further than tolerance from the leader
+        std::vector<std::string> desynced(std::chrono::milliseconds tolerance) const;
+        room_health health() const;
+
+    private:
+        using start_index = std::multimap<std::int64_t, std::string>;
+
+        // These expect mutex to be held
+        void unindex(std::size_t row);
+        void index(std::size_t row);
+        std::size_t leader_row() const;
+        std::size_t members_on_locked(int song) const;
+        std::chrono::milliseconds max_drift_locked() const;
+
+        mutable std::mutex mutex;
+
+        // Columns, row i of each is the same member
+        std::vector<std::string> ip;
+        std::vector<std::uint16_t> rank;
+        std::vector<std::uint16_t> bully_id;
+        std::vector<int> song;
+        std::vector<std::int32_t> elapsed_ms;
+        std::vector<std::int64_t> started_ms;
+        std::vector<std::uint8_t> paused;
+        std::unordered_map<std::string, std::size_t> row_of;
+
+        // Playing members by song, ordered by when their song started
+        std::unordered_map<int, start_index> playing;
+        std::unordered_map<int, std::unordered_set<std::string>> paused_on;
+        std::unordered_map<int, std::size_t> song_members;
+        // Ordered like outranks, so the last one is who the listeners elect
+        std::map<std::pair<std::uint16_t, std::uint16_t>, std::string> by_rank;
+        std::size_t paused_count = 0;
+    };
+}
@@ -1,6 +1,11 @@
 #include "player.hpp"
 #include "networking.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <ranges>
+
 
 namespace player {
     using namespace std::literals::chrono_literals;
@@ -80,18 +85,18 @@ namespace player {
         return message_success;
     }
 
-    static std::string find_coordinator(ClientList& cl)
+    static std::string find_coordinator(const ClientList& cl)
     {
         Client coordinator;
         coordinator.ip = "";
         coordinator.bully_id = 0;
-        for (auto& c : cl.clients)
+        for (const auto& c : cl.clients)
             if (c.bully_id > coordinator.bully_id)
                 coordinator = c;
         return coordinator.ip;
     }
     
-    void MusicPlayer::start_player(ClientList& cl)
+    void MusicPlayer::start_player(std::function<ClientList()> members, std::function<std::string()> leader_ip)
     {
         std::string song_name = "";
 
@@ -101,39 +106,46 @@ namespace player {
         stop_msg.cm.op = ControlOperation::STOP;
         start_msg.cm.op = ControlOperation::START;
         skip_msg.cm.op = ControlOperation::SKIP;
+        for (Message* msg : {&stop_msg, &start_msg, &skip_msg})
+            msg->cm.origin = replica;
+
+        auto coordinator = [&members, leader_ip]()
+        {
+            std::string ip = leader_ip ? leader_ip() : "";
+            return ip.empty() ? find_coordinator(members()) : ip;
+        };
 
+        // Applied here on this frame, the leader's log confirms it or it gets rolled back.
+        // The send doesn't hold up the frame either.
+        auto press = [&, this](Message& msg)
+        {
+            msg.cm.tag = apply_optimistically(msg.cm.op);
+            std::thread{[ip = coordinator(), msg]() { send_msg_to_coordinator(ip, msg); }}.detach();
+        };
 
         std::function<void()> stop_callback = [&,this]() 
         {
-            send_msg_to_coordinator(find_coordinator(cl), stop_msg);
+            press(stop_msg);
         };
 
         std::function<void()> start_callback = [&,this]()
         {
-            send_msg_to_coordinator(find_coordinator(cl), start_msg);
+            press(start_msg);
         };
 
         std::function<void()> skip_callback = [&,this]()
         {
-            send_msg_to_coordinator(find_coordinator(cl), skip_msg);
+            press(skip_msg);
         };
 
         g.start_callback = &start_callback;
         g.stop_callback = &stop_callback;
         g.skip_callback = &skip_callback;
 
-        song_queue.push_back(1);
-        song_queue.push_back(2);
-        song_queue.push_back(1);
-        song_queue.push_back(2);
-        song_queue.push_back(2);
-
-        while (true)
+        while (!stopper.stop_requested() && !WindowShouldClose())
         {
-            if (stopper.stop_requested())
-            {
-                //break;
-            }
+            run_due_commands();
+            roll_back_unconfirmed();
 
             if (!paused)
             {
@@ -142,7 +154,7 @@ namespace player {
                 start_frame = clock.now();
 
                 if (delta_t > 0 && delta_t < 1)
-                    elapsed += delta_t;
+                    elapsed += advance(delta_t);
 
                 bool broke = false;
                 const auto& [artist, name, duration] = songs.at(song_id);
@@ -156,13 +168,14 @@ namespace player {
 
 
                 g.gui_song_queue.clear();
-                for (int si : song_queue)
+                for (int si : song_queue | std::views::drop(skipped_ahead))
                 {
                     const auto& [a, n, d] = songs.at(si);
                     g.gui_song_queue.push_back(std::format("{} - {} : {}", a, n, d));
                 }
 
                 g.gui_client_list.clear();
+                const ClientList cl = members();
                 for (Client c : cl.clients)
                 {
                     std::uint16_t leader = cl.bully_id;
@@ -174,18 +187,35 @@ namespace player {
 
             g.draw_gui();
         }
+
+        // Closing the window stops everything else waiting on the player too
+        stopper.request_stop();
     }
 
-    MusicPlayer::MusicPlayer(int initial_song) : song_id(initial_song) { };
+    static std::uint32_t random_replica()
+    {
+        std::mt19937 gen{std::random_device{}()};
+        return std::uniform_int_distribution<std::uint32_t>{1}(gen);
+    }
+
+    // The same on every replica, so nobody ends up with everyone's copy
+    static const std::deque<int> initial_queue{1, 2, 1, 2, 2};
+
+    MusicPlayer::MusicPlayer(int initial_song, const DriftOptions& drift) : song_id(initial_song), replica(random_replica()), queue_items(replica, initial_queue), drift_options(drift)
+    {
+        song_queue = queue_items.songs();
+        queue_hash.assign(song_queue);
+    }
 
     void MusicPlayer::next_song()
     {
         wait_if_queue_empty();
         INFO("New song detected, acquiring lock to play it")
         std::lock_guard<std::mutex> queue_lock(queue_mutex);
-        song_id = song_queue.front();
-        song_queue.pop_front();
+        song_id = pop_song();
         elapsed = 0.0f;
+        clear_drift();
+        changed();
         INFO("Lock obtained and skipped to new song")
     }
 
@@ -196,41 +226,202 @@ namespace player {
         INFO("Lock obtained, skipping song if queue isn't empty")
         if (!song_queue.empty())
         {
-            song_id = song_queue.front();
-            song_queue.pop_front();
+            song_id = pop_song();
             elapsed = 0.0f;
+            clear_drift();
+            changed();
             INFO("Skipped")
             return;
         }
         INFO("Queue was empty, did not skip")
     }
 
-    void MusicPlayer::add_to_queue(int song_id)
+    std::optional<QueueItem> MusicPlayer::add_to_queue(int song_id)
     {
         INFO("Obtaining lock to add id {} to queue", song_id)
+        std::optional<QueueItem> item;
         {
             std::unique_lock<std::mutex> queue_lock(queue_mutex);
             if (song_queue.size() < MAXIMUM_QUEUE_SIZE)
             {
-                song_queue.emplace_back(song_id);
+                item = push_song(song_id);
             }
         }
         INFO("Added {} to queue", song_id)
         //queue_wait.notify_all();
+        return item;
+    }
+
+    bool MusicPlayer::merge_queue(const QueueDelta& delta)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        return merge_locked(delta.items, {delta.horizon_stamp, delta.horizon_replica});
+    }
+
+    std::vector<QueueDelta> MusicPlayer::queue_snapshot(std::size_t per_chunk)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        // All taken together, a horizon older than the items would let the receiver keep what we let go of
+        const auto horizon = queue_items.horizon();
+        std::vector<QueueDelta> pieces;
+        for (auto& items : queue_items.snapshot(per_chunk))
+        {
+            QueueDelta qd{};
+            qd.items = std::move(items);
+            qd.queue_digest = queue_hash.value();
+            qd.horizon_stamp = horizon.first;
+            qd.horizon_replica = horizon.second;
+            pieces.push_back(std::move(qd));
+        }
+        return pieces;
     }
 
     void MusicPlayer::set_elapsed(int new_elapsed)
     {
         elapsed = new_elapsed;
+        clear_drift();
         INFO("Changed elapsed time to {}", new_elapsed);
     }
 
+    float MusicPlayer::advance(float delta)
+    {
+        std::lock_guard<std::mutex> drift_lock(drift_mutex);
+        const float max_step = drift_options.max_rate_offset * delta;
+        const float step = std::clamp(drift_left, -max_step, max_step);
+        drift_left -= step;
+        return delta + step;
+    }
+
+    void MusicPlayer::correct_to(float target)
+    {
+        std::lock_guard<std::mutex> drift_lock(drift_mutex);
+        const float off = target - elapsed;
+        if (std::abs(off) > drift_options.seek_threshold)
+        {
+            INFO("{:.2f} s off, seeking", off);
+            elapsed = target;
+            drift_left = 0.0f;
+        }
+        else if (std::abs(off) < drift_options.deadband)
+        {
+            drift_left = 0.0f;
+        }
+        else
+        {
+            // Worked off a little every frame, the next correction replaces whatever is left
+            drift_left = off;
+        }
+    }
+
+    void MusicPlayer::clear_drift()
+    {
+        std::lock_guard<std::mutex> drift_lock(drift_mutex);
+        drift_left = 0.0f;
+    }
+
+    void MusicPlayer::log_change(const QueueItem& item)
+    {
+        change_log.push_back({++state_epoch, item});
+        while (change_log.size() > max_logged_changes)
+            change_log.pop_front();
+    }
+
+    QueueItem MusicPlayer::push_song(int id)
+    {
+        // Stamped past everything we have, so it goes to the back
+        const QueueItem item = queue_items.enqueue(id);
+        song_queue.push_back(id);
+        queue_hash.push_back(id);
+        log_change(item);
+        return item;
+    }
+
+    int MusicPlayer::pop_song()
+    {
+        const int id = song_queue.front();
+        song_queue.pop_front();
+        queue_hash.pop_front(id);
+        if (auto tomb = queue_items.pop_front())
+            log_change(*tomb);
+        return id;
+    }
+
+    bool MusicPlayer::merge_locked(const std::vector<QueueItem>& items, hnoker::queue_crdt::item_id horizon)
+    {
+        const std::vector<QueueItem> changed = queue_items.merge(items, horizon);
+        if (changed.empty())
+            return false;
+        for (const QueueItem& item : changed)
+            log_change(item);
+        // Merged items can land anywhere, not just at the ends
+        song_queue = queue_items.songs();
+        queue_hash.assign(song_queue);
+        return true;
+    }
+
+    bool MusicPlayer::is_stale(std::uint32_t lease_epoch, std::uint64_t epoch) const
+    {
+        return std::make_pair(lease_epoch, epoch) < synced_to;
+    }
+
+    std::optional<StateDelta> MusicPlayer::changes_since(std::uint64_t epoch)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        StateDelta delta{};
+        delta.from_epoch = epoch;
+        delta.state_epoch = state_epoch;
+        delta.queue_digest = queue_hash.value();
+
+        // Merging is idempotent, so too much is fine but missing any is not
+        if (epoch > state_epoch || state_epoch - epoch > max_delta_items)
+            return std::nullopt;
+        if (epoch < state_epoch && (change_log.empty() || change_log.front().epoch > epoch + 1))
+            return std::nullopt;
+        for (const StateChange& c : change_log)
+        {
+            if (c.epoch > epoch)
+                delta.items.push_back(c.item);
+        }
+        return delta;
+    }
+
+    bool MusicPlayer::apply_changes(const StateDelta& delta)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        merge_locked(delta.items);
+        if (queue_hash.value() != delta.queue_digest)
+            return false;
+        synced_to = {delta.lease_epoch, delta.state_epoch};
+        return true;
+    }
+
     void MusicPlayer::toggle_pause()
     {
         paused = !paused;
+        changed();
         pause_wait.notify_all();
     }
 
+    void MusicPlayer::changed()
+    {
+        changed_at = hnoker::process_clock().now();
+    }
+
+    std::uint64_t MusicPlayer::last_change() const
+    {
+        return changed_at;
+    }
+
+    bool MusicPlayer::accept_push(std::uint32_t lease_epoch, std::uint64_t sent_at)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        const std::pair<std::uint32_t, std::uint64_t> push{lease_epoch, sent_at};
+        if (push <= pushed_at)
+            return false;
+        pushed_at = push;
+        return true;
+    }
+
     const SendStatus MusicPlayer::get_status() {
         std::lock_guard<std::mutex> queue_lock(queue_mutex);
         SendStatus status
@@ -240,15 +431,251 @@ namespace player {
             paused,
             song_queue,
         };
+        status.state_epoch = state_epoch;
 
         return status;
     }
 
+    Heartbeat MusicPlayer::get_heartbeat()
+    {
+        // Only the fixed size part of the status, the queue stays home
+        Heartbeat hb{};
+        hb.current_song_id = song_id;
+        hb.elapsed_ms = static_cast<std::int32_t>(elapsed * 1000.0f);
+        hb.paused = paused;
+        return hb;
+    }
+
+    void MusicPlayer::schedule(ControlOperation op, time_point<steady_clock> at)
+    {
+        LogEntry entry{};
+        entry.op = op;
+        schedule(entry, at);
+    }
+
+    void MusicPlayer::schedule(const LogEntry& entry, time_point<steady_clock> at)
+    {
+        std::lock_guard<std::mutex> command_lock(command_mutex);
+        pending_commands.emplace(at, entry);
+    }
+
+    void MusicPlayer::run_due_commands()
+    {
+        const auto now = clock.now();
+        while (true)
+        {
+            LogEntry entry;
+            time_point<steady_clock> at;
+            {
+                std::lock_guard<std::mutex> command_lock(command_mutex);
+                if (pending_commands.empty() || pending_commands.begin()->first > now)
+                    return;
+                at = pending_commands.begin()->first;
+                entry = pending_commands.begin()->second;
+                pending_commands.erase(pending_commands.begin());
+            }
+            apply(entry, now - at);
+        }
+    }
+
+    std::uint32_t MusicPlayer::apply_optimistically(ControlOperation op)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        const Optimistic o{++next_tag, op, clock.now(), song_id, elapsed, paused};
+        switch (op)
+        {
+            case ControlOperation::START:
+                if (paused)
+                {
+                    start_frame = clock.now();
+                    toggle_pause();
+                }
+                break;
+            case ControlOperation::STOP:
+                if (!paused)
+                    toggle_pause();
+                break;
+            case ControlOperation::SKIP:
+                // Play what the skip will pop to, the queue itself waits for the log
+                if (song_queue.size() > skipped_ahead)
+                {
+                    song_id = song_queue[skipped_ahead];
+                    skipped_ahead++;
+                    elapsed = 0.0f;
+                    clear_drift();
+                    changed();
+                }
+                break;
+        }
+        optimistic.push_back(o);
+        return o.tag;
+    }
+
+    bool MusicPlayer::confirm(const LogEntry& entry)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        auto it = std::find_if(optimistic.begin(), optimistic.end(), [&](const Optimistic& o) { return o.tag == entry.tag; });
+        if (it == optimistic.end())
+            return false;
+        optimistic.erase(it);
+
+        // The rest already happened here, whatever time it put us off by the schedule takes care of
+        if (entry.op == ControlOperation::SKIP && skipped_ahead > 0)
+        {
+            pop_song();
+            skipped_ahead--;
+        }
+        return true;
+    }
+
+    void MusicPlayer::roll_back_unconfirmed()
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        if (optimistic.empty() || clock.now() - optimistic.front().at < optimistic_timeout)
+            return;
+
+        // Everything after it was pressed on top of it, so that all goes too
+        const Optimistic& o = optimistic.front();
+        INFO("The leader never confirmed command {}, rolling back", o.tag);
+        song_id = o.song_id;
+        elapsed = o.paused ? o.elapsed : o.elapsed + std::chrono::duration<float>(clock.now() - o.at).count();
+        clear_drift();
+        changed();
+        if (paused != o.paused)
+        {
+            start_frame = clock.now();
+            toggle_pause();
+        }
+        optimistic.clear();
+        skipped_ahead = 0;
+    }
+
+    void MusicPlayer::apply(const LogEntry& entry, std::chrono::duration<float> late)
+    {
+        if (entry.origin == replica && confirm(entry))
+            return;
+
+        // We only get to it on the next frame, act as if it happened on time
+        switch (entry.op)
+        {
+            case ControlOperation::START:
+                if (paused)
+                {
+                    start_frame = clock.now();
+                    elapsed = elapsed + late.count();
+                    toggle_pause();
+                }
+                break;
+            case ControlOperation::STOP:
+                if (!paused)
+                {
+                    toggle_pause();
+                    elapsed = std::max(0.0f, elapsed - late.count());
+                }
+                break;
+            case ControlOperation::SKIP:
+                skip();
+                elapsed = late.count();
+                break;
+        }
+    }
+
+    std::uint64_t MusicPlayer::digest_at(std::int32_t position_ms) const
+    {
+        return hnoker::state_digest(song_id, position_ms, paused, queue_hash.value());
+    }
+
+    StateDigest MusicPlayer::digest()
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        StateDigest sd{};
+        sd.digest = digest_at(static_cast<std::int32_t>(elapsed * 1000.0f));
+        // Where the leader's log should pick up for us
+        sd.state_epoch = synced_to.second;
+        sd.queue_digest = queue_hash.value();
+        return sd;
+    }
+
+    bool MusicPlayer::matches(std::uint64_t digest)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        // Rounding can put two close positions in neighbouring buckets, so those count too
+        const std::int32_t position_ms = static_cast<std::int32_t>(elapsed * 1000.0f);
+        for (std::int32_t shift : {0, -hnoker::digest_bucket_ms, hnoker::digest_bucket_ms})
+        {
+            if (digest_at(position_ms + shift) == digest)
+                return true;
+        }
+        return false;
+    }
+
+    PlaybackSchedule MusicPlayer::get_schedule(std::int64_t now_us)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        PlaybackSchedule schedule{};
+        schedule.song_id = song_id;
+        schedule.paused = paused;
+        schedule.position_ms = static_cast<std::int32_t>(elapsed * 1000.0f);
+        schedule.song_started_us = now_us - static_cast<std::int64_t>(elapsed * 1e6f);
+        schedule.digest = digest_at(schedule.position_ms);
+        schedule.state_epoch = state_epoch;
+        return schedule;
+    }
+
+    bool MusicPlayer::follow_schedule(const PlaybackSchedule& schedule, std::int64_t now_us)
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        // The leader hasn't seen what we pressed yet, it would only undo it
+        if (!optimistic.empty())
+            return false;
+        const bool same_song = song_id == schedule.song_id;
+        song_id = schedule.song_id;
+        if (!same_song)
+            changed();
+        if (schedule.paused)
+        {
+            elapsed = schedule.position_ms / 1000.0f;
+            clear_drift();
+        }
+        else if (same_song && !paused)
+        {
+            correct_to(static_cast<float>(now_us - schedule.song_started_us) / 1e6f);
+        }
+        else
+        {
+            elapsed = static_cast<float>(now_us - schedule.song_started_us) / 1e6f;
+            clear_drift();
+        }
+        if (paused != schedule.paused)
+            toggle_pause();
+
+        // Everything but the queue is the leader's now, so a different digest means a different queue
+        return hnoker::state_digest(song_id, schedule.position_ms, paused, queue_hash.value()) != schedule.digest;
+    }
+
     void MusicPlayer::set_status(const SendStatus& status)
     {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex);
+        if (is_stale(status.lease_epoch, status.state_epoch))
+        {
+            INFO("Ignoring state {} under lease {}, we already have newer", status.state_epoch, status.lease_epoch);
+            return;
+        }
+        if (!optimistic.empty())
+            return;
+        if (song_id == status.current_song_id && !paused && !status.paused)
+        {
+            correct_to(status.elapsed_time);
+        }
+        else
+        {
+            elapsed = status.elapsed_time;
+            clear_drift();
+        }
+        if (song_id != status.current_song_id || paused != status.paused)
+            changed();
         song_id = status.current_song_id;
-        elapsed = status.elapsed_time;
         paused = status.paused;
-        song_queue = status.queue;
+        // The queue only ever changes by merging, the one in here is just for show
     }
 }
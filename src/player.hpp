@@ -3,6 +3,9 @@
 #include "logging.hpp"
 #include "message_types.hpp"
 #include "gui.hpp"
+#include "hlc.hpp"
+#include "queue_crdt.hpp"
+#include "state_digest.hpp"
 
 #include <array>
 #include <atomic>
@@ -10,9 +13,12 @@
 #include <condition_variable>
 #include <cstdint>
 #include <deque>
+#include <functional>
 #include <mutex>
+#include <optional>
 #include <format>
 #include <iostream>
+#include <map>
 #include <stop_token>
 #include <thread>
 #include <unordered_map>
@@ -24,13 +30,45 @@ namespace player {
 
     struct Song;
 
+    struct DriftOptions {
+        // How much faster or slower than real time we may play to catch up, 0.05 is 5%
+        float max_rate_offset = 0.05f;
+        // Anything further off than this is a seek, catching up would take too long
+        float seek_threshold = 1.0f;
+        // Close enough, not worth touching the rate for
+        float deadband = 0.01f;
+    };
+
     class MusicPlayer {
     private:
         int song_id;
         steady_clock clock;
         std::jthread thread;
         std::deque<int> song_queue;
+        // Ours alone, for queue items and for knowing our own commands when they come back
+        std::uint32_t replica;
+        // Kept up to date with every change to song_queue
+        hnoker::queue_digest queue_hash;
+        // What song_queue is made from, this is what replicas merge
+        hnoker::queue_crdt queue_items;
         std::mutex queue_mutex;
+
+        struct StateChange {
+            std::uint64_t epoch;
+            QueueItem item;
+        };
+        // Bumped by every queue change, the log lets a follower catch up from any epoch still in it
+        std::uint64_t state_epoch = 0;
+        std::deque<StateChange> change_log;
+        static constexpr std::size_t max_logged_changes = 64;
+        // More than this doesn't fit in a frame, the snapshot is cheaper by then anyway
+        static constexpr std::size_t max_delta_items = 24;
+        // Lease and state epoch of the newest state we took from a leader
+        std::pair<std::uint32_t, std::uint64_t> synced_to{0, 0};
+        // Lease and hlc stamp of the newest status or schedule we took, the last one sent wins
+        std::pair<std::uint32_t, std::uint64_t> pushed_at{0, 0};
+        // When the song or pause last changed here
+        std::atomic<std::uint64_t> changed_at{0};
         std::atomic<float> elapsed;
         std::atomic_bool paused;
         std::mutex pause_mutex;
@@ -44,20 +82,94 @@ namespace player {
         time_point<steady_clock> end_frame;
         float delta_t = 0.0f;
 
+        DriftOptions drift_options;
+        std::mutex drift_mutex;
+        // Seconds we still have to make up, positive means we are behind
+        float drift_left = 0.0f;
+
+        // Pressed here and already applied, waiting for the leader's log to confirm them
+        struct Optimistic {
+            std::uint32_t tag;
+            ControlOperation op;
+            time_point<steady_clock> at;
+            // What to go back to if it never comes
+            int song_id;
+            float elapsed;
+            bool paused;
+        };
+        static constexpr std::chrono::seconds optimistic_timeout{1};
+        std::deque<Optimistic> optimistic;
+        std::uint32_t next_tag = 0;
+        // Queue entries we are already playing past, they are popped once the skips are confirmed
+        std::size_t skipped_ahead = 0;
+
+        std::mutex command_mutex;
+        // Entries at the same time keep the order they were scheduled in, which is log order
+        std::multimap<time_point<steady_clock>, LogEntry> pending_commands;
+
         void pause();
         void wait_if_queue_empty();
+        // Only on the player thread
+        void run_due_commands();
+        void apply(const LogEntry& entry, std::chrono::duration<float> late);
+        std::uint32_t apply_optimistically(ControlOperation op);
+        // True when it was one of ours, which already happened here
+        bool confirm(const LogEntry& entry);
+        void roll_back_unconfirmed();
+        // How far elapsed moves this frame, with part of the drift worked off
+        float advance(float delta);
+        // Pulls elapsed towards target, seeks only when it is too far off
+        void correct_to(float target);
+        void clear_drift();
+        // These expect queue_mutex to be held
+        std::uint64_t digest_at(std::int32_t position_ms) const;
+        void log_change(const QueueItem& item);
+        QueueItem push_song(int id);
+        int pop_song();
+        bool merge_locked(const std::vector<QueueItem>& items, hnoker::queue_crdt::item_id horizon = {});
+        // Whether a full state from a leader is older than what we already have
+        bool is_stale(std::uint32_t lease_epoch, std::uint64_t epoch) const;
+        void changed();
 
     public:
         std::stop_source stopper;
 
-        MusicPlayer(int initial_song);
-        void start_player(ClientList& list);
+        MusicPlayer(int initial_song, const DriftOptions& drift = {});
+        // leader_ip is asked before each control message, empty means fall back to the highest id in the list
+        // members is asked for a copy each frame, the listener changes it from other threads
+        void start_player(std::function<ClientList()> members, std::function<std::string()> leader_ip = {});
         void next_song();
         void skip();
-        void add_to_queue(int song_id);
+        // The new item for the other replicas, empty when the queue is full
+        std::optional<QueueItem> add_to_queue(int song_id);
+        // True when it changed our queue
+        bool merge_queue(const QueueDelta& delta);
+        // The whole queue with its horizon and digest, ask_back is left to the sender
+        std::vector<QueueDelta> queue_snapshot(std::size_t per_chunk);
         void set_elapsed(int new_elapsed);
         void toggle_pause();
         const SendStatus get_status();
+        Heartbeat get_heartbeat();
         void set_status(const SendStatus& status);
+        // Hlc stamp of our last change, a status sent before it can't have seen it
+        std::uint64_t last_change() const;
+        // False for a status or schedule sent before one we already took, those are dropped
+        bool accept_push(std::uint32_t lease_epoch, std::uint64_t sent_at);
+        // Song, position, pause and queue in 64 bits, equal digests mean there is nothing to sync
+        StateDigest digest();
+        // Whether someone else's digest is our state at about our position, see digest_bucket_ms
+        bool matches(std::uint64_t digest);
+        // Empty when that epoch is no longer in the log or too much changed since
+        std::optional<StateDelta> changes_since(std::uint64_t epoch);
+        // True when our queue ended up the same as the leader's, otherwise we have something it doesn't
+        bool apply_changes(const StateDelta& delta);
+
+        // Applied on the player thread once the time comes, a late one makes up for how late it is
+        void schedule(ControlOperation op, time_point<steady_clock> at);
+        void schedule(const LogEntry& entry, time_point<steady_clock> at);
+        // Times are microseconds on the room's timebase
+        PlaybackSchedule get_schedule(std::int64_t now_us);
+        // True when our queue doesn't match the leader's
+        bool follow_schedule(const PlaybackSchedule& schedule, std::int64_t now_us);
     };
 }
@@ -0,0 +1,121 @@
+#include "queue_crdt.hpp"
+
+#include <algorithm>
+
+namespace hnoker
+{
+    // A tombstone only has to outlive the deltas that could still bring its item back
+    static constexpr std::size_t max_tombstones = 256;
+
+    queue_crdt::queue_crdt(std::uint32_t replica, const std::deque<int>& initial) :
+        replica(replica)
+    {
+        for (int song_id : initial)
+        {
+            clock++;
+            items.emplace(item_id{clock, 0}, entry{song_id, false});
+        }
+    }
+
+    QueueItem queue_crdt::enqueue(int song_id)
+    {
+        clock++;
+        items[{clock, replica}] = entry{song_id, false};
+        return QueueItem{clock, replica, song_id, false};
+    }
+
+    std::optional<QueueItem> queue_crdt::pop_front()
+    {
+        for (auto& [id, e] : items)
+        {
+            if (e.removed)
+                continue;
+            e.removed = true;
+            tombstones++;
+            QueueItem tomb{id.first, id.second, e.song_id, true};
+            prune();
+            return tomb;
+        }
+        return std::nullopt;
+    }
+
+    std::vector<QueueItem> queue_crdt::merge(const std::vector<QueueItem>& incoming, item_id their_horizon)
+    {
+        std::vector<QueueItem> changed;
+        if (their_horizon > pruned_through)
+        {
+            // They let go of more than we did, whatever we still have of that is gone for them
+            clock = std::max(clock, their_horizon.first);
+            for (auto it = items.begin(); it != items.end() && it->first <= their_horizon;)
+            {
+                if (it->second.removed)
+                    tombstones--;
+                else
+                    changed.push_back(QueueItem{it->first.first, it->first.second, it->second.song_id, true});
+                it = items.erase(it);
+            }
+            pruned_through = their_horizon;
+        }
+
+        for (const QueueItem& item : incoming)
+        {
+            const item_id id{item.stamp, item.replica};
+            clock = std::max(clock, item.stamp);
+            if (id <= pruned_through)
+                continue;
+
+            auto it = items.find(id);
+            if (it == items.end())
+            {
+                items.emplace(id, entry{item.song_id, item.removed});
+                if (item.removed)
+                    tombstones++;
+                changed.push_back(item);
+            }
+            else if (item.removed && !it->second.removed)
+            {
+                it->second.removed = true;
+                tombstones++;
+                changed.push_back(item);
+            }
+        }
+        prune();
+        std::sort(changed.begin(), changed.end(), [](const QueueItem& a, const QueueItem& b) { return std::pair{a.stamp, a.replica} < std::pair{b.stamp, b.replica}; });
+        return changed;
+    }
+
+    std::deque<int> queue_crdt::songs() const
+    {
+        std::deque<int> out;
+        for (const auto& [id, e] : items)
+        {
+            if (!e.removed)
+                out.push_back(e.song_id);
+        }
+        return out;
+    }
+
+    std::vector<std::vector<QueueItem>> queue_crdt::snapshot(std::size_t per_chunk) const
+    {
+        std::vector<std::vector<QueueItem>> chunks(1);
+        for (const auto& [id, e] : items)
+        {
+            if (chunks.back().size() >= per_chunk)
+                chunks.emplace_back();
+            chunks.back().push_back(QueueItem{id.first, id.second, e.song_id, e.removed});
+        }
+        return chunks;
+    }
+
+    void queue_crdt::prune()
+    {
+        // Only from the front, everything up to the horizon has to be gone. A song still
+        // queued there holds the rest back until it is popped, which is next
+        while (tombstones > max_tombstones && !items.empty() && items.begin()->second.removed)
+        {
+            pruned_through = items.begin()->first;
+            items.erase(items.begin());
+            tombstones--;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "message_types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace hnoker
+{
+    // The song queue as a sequence CRDT. Every song in it is an item with an
+    // id nobody else can make, a Lamport stamp and the replica that added it,
+    // and the queue is the items in id order. An enqueue stamps past anything
+    // we have seen so it lands at the end, and a pop only marks the front item
+    // removed. Merging is a union where removed wins, so replicas that have
+    // seen the same items have the same queue no matter the order or how
+    // often the items got to them.
+    //
+    // Pops take the front, so tombstones pile up at the front of the id order.
+    // Past a limit they are let go of from the front and the horizon moves up
+    // to the last one: everything at or before it is gone. The horizon only
+    // ever grows and merges by taking the larger one, so it goes out with
+    // snapshots and a replica that missed the pops drops those items too.
+    class queue_crdt
+    {
+    public:
+        using item_id = std::pair<std::uint32_t, std::uint32_t>;
+
+        // The initial songs get stamps 1..n and replica 0, so every replica that starts
+        // from the same queue has the same items before anything is merged
+        explicit queue_crdt(std::uint32_t replica, const std::deque<int>& initial = {});
+
+        QueueItem enqueue(int song_id);
+        // The tombstone of what was at the front
+        std::optional<QueueItem> pop_front();
+        // The items that changed anything here, in id order. Anything the horizon
+        // drops comes back as a tombstone
+        std::vector<QueueItem> merge(const std::vector<QueueItem>& items, item_id their_horizon = {});
+
+        std::deque<int> songs() const;
+        // Everything we know of past the horizon, tombstones too, in pieces small enough for
+        // a frame. Always at least one piece, so the horizon has something to go out with
+        std::vector<std::vector<QueueItem>> snapshot(std::size_t per_chunk) const;
+        // Stamp and replica of the last tombstone let go of, {0, 0} before any were
+        item_id horizon() const { return pruned_through; }
+
+    private:
+        struct entry
+        {
+            int song_id;
+            bool removed;
+        };
+
+        void prune();
+
+        std::uint32_t replica;
+        std::uint32_t clock = 0;
+        std::map<item_id, entry> items;
+        std::size_t tombstones = 0;
+        item_id pruned_through{0, 0};
+    };
+}
@@ -0,0 +1,46 @@
+#include "rate_limit.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace hnoker
+{
+    token_bucket::token_bucket(double rate_per_second, double burst, clock::time_point now) :
+        rate_per_second(rate_per_second),
+        burst(burst),
+        tokens(burst),
+        last_refill(now)
+    {}
+
+    bool token_bucket::try_take(clock::time_point now, double wanted)
+    {
+        refill(now);
+        if (tokens < wanted)
+            return false;
+        tokens -= wanted;
+        return true;
+    }
+
+    std::chrono::milliseconds token_bucket::time_until_available(clock::time_point now, double wanted)
+    {
+        refill(now);
+        if (tokens >= wanted || rate_per_second <= 0.0)
+            return std::chrono::milliseconds(0);
+        return std::chrono::milliseconds(static_cast<long long>(std::ceil((wanted - tokens) / rate_per_second * 1000.0)));
+    }
+
+    bool token_bucket::is_full(clock::time_point now) const
+    {
+        const double seconds = now > last_refill ? std::chrono::duration<double>(now - last_refill).count() : 0.0;
+        return tokens + seconds * rate_per_second >= burst;
+    }
+
+    void token_bucket::refill(clock::time_point now)
+    {
+        if (now <= last_refill)
+            return;
+        const double seconds = std::chrono::duration<double>(now - last_refill).count();
+        tokens = std::min(burst, tokens + seconds * rate_per_second);
+        last_refill = now;
+    }
+}
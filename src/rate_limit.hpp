@@ -0,0 +1,28 @@
+#pragma once
+
+#include <chrono>
+
+namespace hnoker
+{
+    // Classic token bucket, refills at rate tokens per second up to burst
+    class token_bucket
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        token_bucket(double rate_per_second, double burst, clock::time_point now = clock::now());
+
+        bool try_take(clock::time_point now, double tokens = 1.0);
+        std::chrono::milliseconds time_until_available(clock::time_point now, double tokens = 1.0);
+        bool is_full(clock::time_point now) const;
+        double rate() const { return rate_per_second; }
+
+    private:
+        void refill(clock::time_point now);
+
+        double rate_per_second;
+        double burst;
+        double tokens;
+        clock::time_point last_refill;
+    };
+}
@@ -0,0 +1,246 @@
+#include "region.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+
+namespace hnoker
+{
+    using std::chrono::steady_clock;
+
+    // Path entries per REGION_SUMMARY, more than this doesn't fit in a frame next to the leader
+    static constexpr std::size_t path_per_summary = 16;
+
+    static bool same_clients(const std::vector<Client>& a, const std::vector<Client>& b)
+    {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Client& x, const Client& y)
+        {
+            return x.ip == y.ip && x.port == y.port && x.bully_id == y.bully_id && x.rank == y.rank;
+        });
+    }
+
+    static std::optional<Client> best_ranked(const std::vector<Client>& clients)
+    {
+        auto it = std::max_element(clients.begin(), clients.end(), [](const Client& a, const Client& b) { return outranks(b, a); });
+        if (it == clients.end())
+            return std::nullopt;
+        return *it;
+    }
+
+    region_tree::region_tree(const region_options& options, std::uint16_t own_port, fanout& fan, region_callbacks callbacks) :
+        options(options),
+        own_port(own_port),
+        fan(fan),
+        callbacks(std::move(callbacks))
+    {}
+
+    region_tree::~region_tree()
+    {
+        thread.request_stop();
+    }
+
+    void region_tree::start()
+    {
+        if (options.parent)
+            INFO("Connector is region {} under {}:{}", options.region, options.parent->ip, options.parent->port);
+        thread = std::jthread{[this](std::stop_token st) { run(st); }};
+    }
+
+    void region_tree::handle_summary(const RegionSummary& su, const std::string& sender_ip)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (su.downstream)
+        {
+            // Only our own parent knows the way back down to us
+            if (!options.parent || sender_ip != options.parent->ip || su.port != options.parent->port)
+            {
+                INFO("Ignoring a region path from {}:{}, it isn't our parent", sender_ip, su.port);
+                return;
+            }
+            if (auto path = assemble_path(su))
+                parent_path = std::move(*path);
+            return;
+        }
+
+        auto [it, inserted] = children.try_emplace(su.region);
+        if (inserted)
+        {
+            INFO("Region {} at {}:{} joined the tree", su.region, sender_ip, su.port);
+        }
+        else if (it->second.ip != sender_ip || it->second.port != su.port)
+        {
+            // Two children with the same id would keep overwriting each other, the first one keeps it until it times out
+            INFO("Region {} is already at {}:{}, ignoring the report from {}:{}", su.region, it->second.ip, it->second.port, sender_ip, su.port);
+            return;
+        }
+
+        child& c = it->second;
+        c.ip = sender_ip;
+        c.port = su.port;
+        c.members = su.members;
+        c.leader = su.leader;
+        c.last_heard = steady_clock::now();
+    }
+
+    std::optional<std::vector<Client>> region_tree::assemble_path(const RegionSummary& su)
+    {
+        if (su.parts <= 1)
+            return su.path;
+        if (su.part >= su.parts)
+            return std::nullopt;
+        if (incoming_id != su.path_id || incoming_parts.size() != su.parts)
+        {
+            // A newer path, whatever we had of the last one is no use now
+            incoming_id = su.path_id;
+            incoming_parts.assign(su.parts, {});
+            incoming_have.assign(su.parts, false);
+            incoming_count = 0;
+        }
+        if (!incoming_have[su.part])
+            incoming_count++;
+        incoming_have[su.part] = true;
+        incoming_parts[su.part] = su.path;
+        if (incoming_count < su.parts)
+            return std::nullopt;
+
+        std::vector<Client> path;
+        for (const auto& part : incoming_parts)
+            path.insert(path.end(), part.begin(), part.end());
+        incoming_parts.clear();
+        incoming_have.clear();
+        incoming_count = 0;
+        return path;
+    }
+
+    void region_tree::send(const endpoint& to, const Message& msg)
+    {
+        try
+        {
+            fan.send({to.ip}, to.port, msg);
+        }
+        catch (const std::exception& e)
+        {
+            // Better to miss one summary than to take the whole connector down, they are resent anyway
+            WARN("Couldn't send a region summary to {}:{}: {}", to.ip, to.port, e.what());
+        }
+    }
+
+    std::vector<Client> region_tree::upstream()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return upstream_locked();
+    }
+
+    std::vector<Client> region_tree::upstream_locked() const
+    {
+        std::vector<Client> up = parent_path;
+        for (const auto& [region, c] : children)
+        {
+            if (c.members > 0)
+                up.push_back(c.leader);
+        }
+        return up;
+    }
+
+    void region_tree::run(std::stop_token st)
+    {
+        std::uint64_t tick = 0;
+        while (!st.stop_requested())
+        {
+            std::this_thread::sleep_for(options.report_interval);
+            tick++;
+            if (!callbacks.active())
+                continue;
+
+            const auto local = callbacks.local_members();
+            const auto local_leader = best_ranked(local);
+            const auto now = steady_clock::now();
+
+            std::vector<std::pair<endpoint, Message>> downstream;
+            Message report{ MessageType::REGION_SUMMARY };
+            std::optional<std::vector<Client>> upstream_changed;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                std::erase_if(children, [&](const auto& entry)
+                {
+                    const bool expired = now - entry.second.last_heard > options.child_timeout;
+                    if (expired)
+                        INFO("Region {} stopped reporting, dropping it", entry.first);
+                    return expired;
+                });
+
+                std::uint32_t total = static_cast<std::uint32_t>(local.size());
+                std::optional<Client> leader = local_leader;
+                for (const auto& [region, c] : children)
+                {
+                    total += c.members;
+                    if (c.members > 0 && (!leader || outranks(c.leader, *leader)))
+                        leader = c.leader;
+                }
+
+                // Every child hears about everyone except its own subtree
+                for (auto& [region, c] : children)
+                {
+                    Message down{ MessageType::REGION_SUMMARY };
+                    down.su.region = region;
+                    down.su.downstream = true;
+                    down.su.port = own_port;
+                    down.su.members = total;
+                    down.su.path = parent_path;
+                    if (local_leader)
+                        down.su.path.push_back(*local_leader);
+                    for (const auto& [other_region, other] : children)
+                    {
+                        if (other_region != region && other.members > 0)
+                            down.su.path.push_back(other.leader);
+                    }
+
+                    // Resent now and then in case one got lost
+                    if (!same_clients(down.su.path, c.sent_path) || tick % 5 == 0)
+                    {
+                        c.sent_path = down.su.path;
+                        const std::vector<Client>& path = c.sent_path;
+                        const std::size_t parts = std::max<std::size_t>((path.size() + path_per_summary - 1) / path_per_summary, 1);
+                        down.su.path_id = ++paths_sent;
+                        down.su.parts = static_cast<std::uint16_t>(parts);
+                        for (std::size_t part = 0; part < parts; part++)
+                        {
+                            const auto first = path.begin() + std::min(part * path_per_summary, path.size());
+                            const auto last = path.begin() + std::min((part + 1) * path_per_summary, path.size());
+                            down.su.path.assign(first, last);
+                            down.su.part = static_cast<std::uint16_t>(part);
+                            downstream.emplace_back(endpoint{c.ip, c.port}, down);
+                        }
+                    }
+                }
+
+                report.su.region = options.region;
+                report.su.downstream = false;
+                report.su.port = own_port;
+                report.su.members = total;
+                if (leader)
+                    report.su.leader = *leader;
+
+                auto up = upstream_locked();
+                if (!same_clients(up, sent_upstream))
+                {
+                    sent_upstream = up;
+                    upstream_changed = std::move(up);
+                }
+
+                if (!options.parent && !children.empty() && total != last_total)
+                    INFO("Cluster has {} members in {} regions", total, children.size() + 1);
+                last_total = total;
+            }
+
+            for (auto& [ep, msg] : downstream)
+                send(ep, msg);
+
+            if (options.parent)
+                send(*options.parent, report);
+
+            if (upstream_changed)
+                callbacks.upstream_changed(*upstream_changed);
+        }
+    }
+}
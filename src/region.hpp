@@ -0,0 +1,93 @@
+#pragma once
+
+#include "fanout.hpp"
+#include "message_types.hpp"
+#include "networking.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hnoker
+{
+    struct region_options
+    {
+        // Connector one level up, none means this one is the root
+        std::optional<endpoint> parent;
+        // Has to be unique among the parent's children, so it is required with a parent
+        std::uint16_t region = 0;
+        std::chrono::milliseconds report_interval{1000};
+        // Child regions that stop reporting for this long are dropped
+        std::chrono::milliseconds child_timeout{3000};
+    };
+
+    struct region_callbacks
+    {
+        std::function<std::vector<Client>()> local_members;
+        // The leaders outside our own region changed, local listeners need a new list
+        std::function<void(const std::vector<Client>& upstream)> upstream_changed;
+        // Only the primary replica of a region takes part in the tree
+        std::function<bool()> active;
+    };
+
+    // Connectors arranged in a tree. Every connector only sends lists to its own
+    // listeners, and reports a summary (member count and best ranked listener) to its
+    // parent. Parents answer with the leaders of every other region, so each
+    // listener holds its own region plus one entry per region instead of everyone.
+    class region_tree
+    {
+    public:
+        region_tree(const region_options& options, std::uint16_t own_port, fanout& fan, region_callbacks callbacks);
+        ~region_tree();
+
+        void start();
+        void handle_summary(const RegionSummary& su, const std::string& sender_ip);
+        // What local listeners get as their upstream
+        std::vector<Client> upstream();
+
+    private:
+        struct child
+        {
+            std::string ip;
+            std::uint16_t port;
+            std::uint32_t members = 0;
+            Client leader;
+            std::chrono::steady_clock::time_point last_heard;
+            std::vector<Client> sent_path;
+        };
+
+        void run(std::stop_token st);
+        std::vector<Client> upstream_locked() const;
+        // Gives the whole path once every part of it is in, expects mutex to be held
+        std::optional<std::vector<Client>> assemble_path(const RegionSummary& su);
+        void send(const endpoint& to, const Message& msg);
+
+        region_options options;
+        std::uint16_t own_port;
+        fanout& fan;
+        region_callbacks callbacks;
+
+        std::mutex mutex;
+        std::map<std::uint16_t, child> children;
+        std::vector<Client> parent_path;
+        std::vector<Client> sent_upstream;
+        std::uint32_t last_total = 0;
+        std::uint32_t paths_sent = 0;
+
+        std::uint32_t incoming_id = 0;
+        std::vector<std::vector<Client>> incoming_parts;
+        std::vector<bool> incoming_have;
+        std::size_t incoming_count = 0;
+
+        std::jthread thread;
+    };
+}
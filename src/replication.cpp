@@ -0,0 +1,211 @@
+#include "replication.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace hnoker
+{
+    using std::chrono::steady_clock;
+
+    connector_replication::connector_replication(const replication_options& options, fanout& fan, replication_callbacks callbacks) :
+        options(options),
+        fan(fan),
+        callbacks(std::move(callbacks)),
+        primary(options.replicas.size() <= 1),
+        peers(options.replicas.size()),
+        started(steady_clock::now())
+    {}
+
+    connector_replication::~connector_replication()
+    {
+        thread.request_stop();
+    }
+
+    void connector_replication::start()
+    {
+        if (options.replicas.size() <= 1)
+            return;
+
+        INFO("Starting as replica {}/{}, waiting {} ms to hear from a primary", options.index, options.replicas.size(), options.failover_timeout.count());
+        started = steady_clock::now();
+        thread = std::jthread{[this](std::stop_token st) { run(st); }};
+    }
+
+    void connector_replication::heard_from(const Client& client)
+    {
+        if (primary)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (std::find(heard.begin(), heard.end(), client) == heard.end())
+            heard.push_back(client);
+    }
+
+    void connector_replication::handle_sync(const ReplicaSync& rs)
+    {
+        if (rs.replica_index >= peers.size() || rs.replica_index == options.index)
+            return;
+
+        bool install = false;
+        bool refresh = false;
+        std::vector<Client> table;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            peer& p = peers[rs.replica_index];
+            p.last_heard = steady_clock::now();
+            p.claims_primary = rs.primary;
+            p.term = rs.term;
+
+            if (rs.primary)
+            {
+                if (primary && (rs.term > term || (rs.term == term && rs.replica_index < options.index)))
+                {
+                    INFO("Replica {} is primary with term {}, stepping down", rs.replica_index, rs.term);
+                    primary = false;
+                }
+
+                if (!primary && rs.full_table && rs.parts > 0 && rs.part < rs.parts)
+                {
+                    term = std::max(term, rs.term);
+                    if (incoming_from != rs.replica_index || incoming_id != rs.table_id || incoming_parts.size() != rs.parts)
+                    {
+                        // A newer table, whatever we had of the last one is no use now
+                        incoming_from = rs.replica_index;
+                        incoming_id = rs.table_id;
+                        incoming_parts.assign(rs.parts, {});
+                        incoming_have.assign(rs.parts, false);
+                        incoming_count = 0;
+                    }
+                    if (!incoming_have[rs.part])
+                        incoming_count++;
+                    incoming_have[rs.part] = true;
+                    incoming_parts[rs.part] = rs.clients;
+
+                    if (incoming_count == rs.parts)
+                    {
+                        install = true;
+                        for (const auto& clients : incoming_parts)
+                            table.insert(table.end(), clients.begin(), clients.end());
+                        incoming_parts.clear();
+                        incoming_have.clear();
+                        incoming_count = 0;
+                    }
+                }
+                else if (!primary)
+                {
+                    term = std::max(term, rs.term);
+                }
+            }
+            else
+            {
+                refresh = primary;
+            }
+        }
+
+        if (install)
+            callbacks.install(table);
+        else if (refresh && !rs.clients.empty())
+            callbacks.refresh(rs.clients);
+    }
+
+    void connector_replication::run(std::stop_token st)
+    {
+        std::uint64_t tick = 0;
+        while (!st.stop_requested())
+        {
+            std::this_thread::sleep_for(options.sync_interval);
+            tick++;
+
+            const auto now = steady_clock::now();
+            bool promoted = false;
+            Message sync{ MessageType::REPLICA_SYNC };
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (!primary)
+                {
+                    bool primary_alive = false;
+                    bool lower_alive = false;
+                    std::uint32_t highest_term = term;
+                    for (std::size_t i = 0; i < peers.size(); i++)
+                    {
+                        if (i == options.index || !heard_recently(peers[i], now))
+                            continue;
+                        primary_alive |= peers[i].claims_primary;
+                        lower_alive |= i < options.index;
+                        highest_term = std::max(highest_term, peers[i].term);
+                    }
+
+                    // The lowest ranked live replica takes over, after giving a primary time to show up
+                    if (!primary_alive && !lower_alive && now - started > options.failover_timeout)
+                    {
+                        term = highest_term + 1;
+                        primary = true;
+                        promoted = true;
+                        INFO("No primary heard for {} ms, replica {} taking over with term {}", options.failover_timeout.count(), options.index, term);
+                    }
+                }
+
+                sync.rs.replica_index = static_cast<std::uint16_t>(options.index);
+                sync.rs.term = term;
+                sync.rs.primary = primary;
+                sync.rs.full_table = false;
+
+                if (!primary)
+                {
+                    sync.rs.clients = std::move(heard);
+                    heard.clear();
+                }
+                else if (version != sent_version || tick % 10 == 0)
+                {
+                    // Full table when it changed, and every now and then in case a standby missed one
+                    sync.rs.full_table = true;
+                    sent_version = version;
+                }
+            }
+
+            if (promoted)
+                callbacks.promoted();
+
+            std::vector<Client> clients = sync.rs.full_table ? callbacks.snapshot() : std::move(sync.rs.clients);
+            const std::size_t per_sync = std::max<std::size_t>(options.clients_per_sync, 1);
+            const std::size_t parts = std::max<std::size_t>((clients.size() + per_sync - 1) / per_sync, 1);
+            sync.rs.table_id = ++tables_sent;
+            sync.rs.parts = static_cast<std::uint16_t>(parts);
+            for (std::size_t part = 0; part < parts; part++)
+            {
+                const auto first = clients.begin() + std::min(part * per_sync, clients.size());
+                const auto last = clients.begin() + std::min((part + 1) * per_sync, clients.size());
+                sync.rs.clients.assign(first, last);
+                sync.rs.part = static_cast<std::uint16_t>(part);
+                send_to_replicas(sync);
+            }
+        }
+    }
+
+    void connector_replication::send_to_replicas(const Message& sync)
+    {
+        // Replicas may share a host on different ports, so one send each
+        for (std::size_t i = 0; i < options.replicas.size(); i++)
+        {
+            if (i == options.index)
+                continue;
+            try
+            {
+                fan.send({options.replicas[i].ip}, options.replicas[i].port, sync);
+            }
+            catch (const std::exception& e)
+            {
+                // Better to miss one sync than to take the whole connector down
+                INFO("Couldn't send replica sync to {}:{}: {}", options.replicas[i].ip, options.replicas[i].port, e.what());
+                return;
+            }
+        }
+    }
+
+    bool connector_replication::heard_recently(const peer& p, steady_clock::time_point now) const
+    {
+        return now - p.last_heard < options.failover_timeout;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "fanout.hpp"
+#include "message_types.hpp"
+#include "networking.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+namespace hnoker
+{
+    struct replication_options
+    {
+        // Every replica in failover order, this one included. Empty means no replication.
+        std::vector<endpoint> replicas;
+        std::size_t index = 0;
+        std::chrono::milliseconds sync_interval{150};
+        std::chrono::milliseconds failover_timeout{600};
+        // Clients per REPLICA_SYNC, frames have to fit the 1024 byte buffers
+        std::size_t clients_per_sync = 16;
+    };
+
+    struct replication_callbacks
+    {
+        std::function<std::vector<Client>()> snapshot;
+        std::function<void(const std::vector<Client>&)> install;
+        std::function<void(const std::vector<Client>&)> refresh;
+        std::function<void()> promoted;
+    };
+
+    // Hot standby replication of the connector membership table. The primary
+    // streams its table to the standbys, standbys forward which listeners have
+    // been heartbeating to them. When the primary goes quiet the lowest ranked
+    // live standby takes over with a higher term, and a primary that hears of a
+    // higher term (or an equal one from a lower rank) steps down.
+    class connector_replication
+    {
+    public:
+        connector_replication(const replication_options& options, fanout& fan, replication_callbacks callbacks);
+        ~connector_replication();
+
+        void start();
+        bool is_primary() const { return primary; }
+        void membership_changed() { version++; }
+        void heard_from(const Client& client);
+        void handle_sync(const ReplicaSync& rs);
+
+    private:
+        struct peer
+        {
+            std::chrono::steady_clock::time_point last_heard{};
+            bool claims_primary = false;
+            std::uint32_t term = 0;
+        };
+
+        void run(std::stop_token st);
+        bool heard_recently(const peer& p, std::chrono::steady_clock::time_point now) const;
+        void send_to_replicas(const Message& sync);
+
+        replication_options options;
+        fanout& fan;
+        replication_callbacks callbacks;
+
+        std::atomic_bool primary;
+        std::atomic<std::uint64_t> version{0};
+
+        std::mutex mutex;
+        std::uint32_t term = 0;
+        std::uint64_t sent_version = 0;
+        std::vector<peer> peers;
+        std::vector<Client> heard;
+        std::chrono::steady_clock::time_point started;
+        std::uint64_t tables_sent = 0;
+
+        // The full table being put together from its parts
+        std::uint16_t incoming_from = 0;
+        std::uint64_t incoming_id = 0;
+        std::vector<std::vector<Client>> incoming_parts;
+        std::vector<bool> incoming_have;
+        std::size_t incoming_count = 0;
+
+        std::jthread thread;
+    };
+}
@@ -0,0 +1,73 @@
+#include "state_digest.hpp"
+
+namespace hnoker
+{
+    // Odd, so it has an inverse modulo 2^64 and a pop can undo a push
+    static constexpr std::uint64_t base = 0x9e3779b97f4a7c15ull;
+
+    static constexpr std::uint64_t inverse(std::uint64_t b)
+    {
+        // Newton's iteration, every step doubles the correct bits
+        std::uint64_t x = b;
+        for (int i = 0; i < 6; i++)
+            x *= 2 - b * x;
+        return x;
+    }
+
+    static constexpr std::uint64_t base_inverse = inverse(base);
+    static_assert(base * base_inverse == 1);
+
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    static std::uint64_t song_hash(int song_id)
+    {
+        return mix(static_cast<std::uint64_t>(static_cast<std::uint32_t>(song_id)) + 1);
+    }
+
+    void queue_digest::push_back(int song_id)
+    {
+        hash = hash * base + song_hash(song_id);
+        front_weight = size == 0 ? 1 : front_weight * base;
+        size++;
+    }
+
+    void queue_digest::pop_front(int song_id)
+    {
+        if (size == 0)
+            return;
+        hash -= song_hash(song_id) * front_weight;
+        size--;
+        front_weight = size == 0 ? 0 : front_weight * base_inverse;
+    }
+
+    void queue_digest::assign(const std::deque<int>& queue)
+    {
+        hash = 0;
+        front_weight = 0;
+        size = 0;
+        for (int song_id : queue)
+            push_back(song_id);
+    }
+
+    std::uint64_t queue_digest::value() const
+    {
+        return mix(hash ^ mix(size));
+    }
+
+    std::uint64_t state_digest(int song_id, std::int32_t position_ms, bool paused, std::uint64_t queue)
+    {
+        const std::int32_t bucket = (position_ms + digest_bucket_ms / 2) / digest_bucket_ms;
+        std::uint64_t d = mix(song_hash(song_id) ^ static_cast<std::uint32_t>(bucket));
+        d = mix(d ^ (paused ? 0x5bd1e995ull : 0));
+        return mix(d ^ queue);
+    }
+}
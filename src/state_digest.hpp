@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace hnoker
+{
+    // Positions are rounded to buckets this wide before hashing. Rounding alone can split
+    // two close positions (499 and 501 ms), so comparisons also try the neighbouring
+    // buckets: positions up to one bucket apart always match, up to one and a half may
+    constexpr std::int32_t digest_bucket_ms = 1000;
+
+    // Hash of the song queue that follows pushes to the back and pops from the
+    // front in constant time, so it never has to walk the queue again. Two
+    // queues with the same songs in the same order hash the same, no matter how
+    // they got there.
+    class queue_digest
+    {
+    public:
+        void push_back(int song_id);
+        void pop_front(int song_id);
+        void assign(const std::deque<int>& queue);
+        std::uint64_t value() const;
+
+    private:
+        std::uint64_t hash = 0;
+        // base to the power of size - 1, what the front song is multiplied by
+        std::uint64_t front_weight = 0;
+        std::size_t size = 0;
+    };
+
+    std::uint64_t state_digest(int song_id, std::int32_t position_ms, bool paused, std::uint64_t queue);
+}
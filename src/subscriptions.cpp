@@ -0,0 +1,230 @@
+#include "subscriptions.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+
+namespace hnoker
+{
+    static bool same_clients(const std::vector<Client>& a, const std::vector<Client>& b)
+    {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Client& x, const Client& y)
+        {
+            return x.ip == y.ip && x.bully_id == y.bully_id && x.rank == y.rank;
+        });
+    }
+
+    // Nothing in the stream should take the connector down, a frame that can't be built is left out
+    static frame_ptr encode(const Message& msg)
+    {
+        try
+        {
+            return make_frame(msg);
+        }
+        catch (const std::exception& e)
+        {
+            WARN("Couldn't build a membership frame: {}", e.what());
+            return nullptr;
+        }
+    }
+
+    static void send_to(const channel_ptr& channel, const frame_ptr& frame)
+    {
+        if (frame)
+            channel->send(frame);
+    }
+
+    membership_stream::membership_stream(const subscription_options& options) :
+        options(options)
+    {
+        // A restarted connector must not look like it continues the old stream
+        std::random_device dev;
+        std::uniform_int_distribution<std::uint32_t> dist{1, std::numeric_limits<std::uint32_t>::max()};
+        epoch = dist(dev);
+    }
+
+    void membership_stream::subscribe(const std::string& ip, const Subscribe& sb, channel_ptr channel, const std::vector<Client>& table)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        channels[ip] = channel;
+
+        const std::uint64_t oldest = history.empty() ? seq + 1 : history.front().seq;
+        const bool can_resume = sb.epoch == epoch && sb.resume_from <= seq && sb.resume_from + 1 >= oldest;
+        if (!can_resume)
+        {
+            INFO("{} subscribed to membership, sending a snapshot at {}", ip, seq);
+            send_snapshot(channel, ip, table);
+            return;
+        }
+
+        INFO("{} resumed membership stream from {}, {} updates behind", ip, sb.resume_from, seq - sb.resume_from);
+        auto it = std::find_if(history.begin(), history.end(), [&](const entry& e) { return e.seq > sb.resume_from; });
+        Message frame = events();
+        frame.me.seq = sb.resume_from;
+        do
+        {
+            for (; it != history.end() && frame.me.updates.size() < options.updates_per_frame; ++it)
+            {
+                frame.me.updates.push_back(it->update);
+                frame.me.seq = it->seq;
+            }
+            // An empty frame still tells them they are caught up
+            send_to(channel, encode(frame));
+            frame.me.updates.clear();
+        } while (it != history.end());
+        // The upstream may have changed while they were away
+        for (const frame_ptr& up : upstream_frames())
+            send_to(channel, up);
+    }
+
+    bool membership_stream::is_subscribed(const std::string& ip)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return channel_for(ip) != nullptr;
+    }
+
+    void membership_stream::joined(const Client& client, const std::vector<Client>& table)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        publish(MemberUpdate{client, MemberState::ALIVE, 0}, client.ip);
+        if (channel_ptr channel = channel_for(client.ip))
+            send_snapshot(channel, client.ip, table);
+    }
+
+    void membership_stream::left(const Client& client)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        publish(MemberUpdate{client, MemberState::DEAD, 0}, "");
+    }
+
+    void membership_stream::updated(const Client& client)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        publish(MemberUpdate{client, MemberState::ALIVE, 0}, "");
+    }
+
+    void membership_stream::set_upstream(const std::vector<Client>& new_upstream)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (same_clients(upstream, new_upstream))
+            return;
+        upstream = new_upstream;
+        for (const frame_ptr& frame : upstream_frames())
+            broadcast(frame, "");
+    }
+
+    void membership_stream::resync(const std::vector<Client>& table)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        seq++;
+        history.clear();
+        for (auto& [ip, channel] : channels)
+        {
+            if (channel->is_open())
+                send_snapshot(channel, ip, table);
+        }
+    }
+
+    void membership_stream::push(const Message& msg, const std::string& skip_ip)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        broadcast(encode(msg), skip_ip);
+    }
+
+    void membership_stream::publish(const MemberUpdate& update, const std::string& skip_ip)
+    {
+        history.push_back(entry{++seq, update});
+        while (history.size() > options.history)
+            history.pop_front();
+
+        Message frame = events();
+        frame.me.updates.push_back(update);
+        broadcast(encode(frame), skip_ip);
+    }
+
+    void membership_stream::broadcast(const frame_ptr& frame, const std::string& skip_ip)
+    {
+        // One serialized frame shared by every subscriber
+        if (!frame)
+            return;
+        std::erase_if(channels, [](const auto& c) { return !c.second->is_open(); });
+        for (auto& [ip, channel] : channels)
+        {
+            if (ip != skip_ip)
+                channel->send(frame);
+        }
+    }
+
+    void membership_stream::send_snapshot(const channel_ptr& channel, const std::string& ip, const std::vector<Client>& table) const
+    {
+        Message frame = events();
+        frame.me.snapshot = true;
+        for (const Client& c : table)
+        {
+            if (c.ip == ip)
+                frame.me.bully_id = c.bully_id;
+        }
+
+        // The stream keeps them in order, so the parts only need counting
+        const std::size_t per_frame = std::max<std::size_t>(options.updates_per_frame, 1);
+        const std::size_t parts = std::max<std::size_t>((table.size() + per_frame - 1) / per_frame, 1);
+        frame.me.parts = static_cast<std::uint16_t>(parts);
+        for (std::size_t part = 0; part < parts; part++)
+        {
+            const auto first = table.begin() + std::min(part * per_frame, table.size());
+            const auto last = table.begin() + std::min((part + 1) * per_frame, table.size());
+            frame.me.clients.assign(first, last);
+            frame.me.part = static_cast<std::uint16_t>(part);
+            send_to(channel, encode(frame));
+        }
+        for (const frame_ptr& up : upstream_frames())
+            send_to(channel, up);
+    }
+
+    std::vector<frame_ptr> membership_stream::upstream_frames() const
+    {
+        // Split like a snapshot, an empty upstream still needs its one frame to clear the old one
+        Message frame = events();
+        const std::size_t per_frame = std::max<std::size_t>(options.updates_per_frame, 1);
+        const std::size_t parts = std::max<std::size_t>((upstream.size() + per_frame - 1) / per_frame, 1);
+        frame.me.upstream_parts = static_cast<std::uint16_t>(parts);
+        std::vector<frame_ptr> frames;
+        for (std::size_t part = 0; part < parts; part++)
+        {
+            const auto first = upstream.begin() + std::min(part * per_frame, upstream.size());
+            const auto last = upstream.begin() + std::min((part + 1) * per_frame, upstream.size());
+            frame.me.upstream.assign(first, last);
+            frame.me.upstream_part = static_cast<std::uint16_t>(part);
+            frame_ptr encoded = encode(frame);
+            // A missing part would only get the subscriber to resubscribe, better to send none of them
+            if (!encoded)
+                return {};
+            frames.push_back(std::move(encoded));
+        }
+        return frames;
+    }
+
+    Message membership_stream::events() const
+    {
+        Message frame{ MessageType::MEMBERSHIP_EVENTS };
+        frame.me.epoch = epoch;
+        frame.me.seq = seq;
+        frame.me.snapshot = false;
+        frame.me.bully_id = 0;
+        return frame;
+    }
+
+    channel_ptr membership_stream::channel_for(const std::string& ip)
+    {
+        auto it = channels.find(ip);
+        if (it == channels.end())
+            return nullptr;
+        if (!it->second->is_open())
+        {
+            channels.erase(it);
+            return nullptr;
+        }
+        return it->second;
+    }
+}
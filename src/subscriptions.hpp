@@ -0,0 +1,70 @@
+#pragma once
+
+#include "message_types.hpp"
+#include "networking.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hnoker
+{
+    struct subscription_options
+    {
+        // Updates kept for subscribers that reconnect, anyone further behind gets a snapshot
+        std::size_t history = 1024;
+        // Updates or snapshot members per frame, frames have to fit the 1024 byte buffers
+        std::size_t updates_per_frame = 8;
+    };
+
+    // Membership as a sequence numbered stream of joins and leaves, pushed over the
+    // connection each listener keeps open for its heartbeats. A listener that
+    // reconnects says where it left off and only gets what it missed. The connector
+    // calls this with clients_mutex held so the stream is in the same order as the table.
+    class membership_stream
+    {
+    public:
+        explicit membership_stream(const subscription_options& options = {});
+
+        void subscribe(const std::string& ip, const Subscribe& sb, channel_ptr channel, const std::vector<Client>& table);
+        bool is_subscribed(const std::string& ip);
+
+        // The joiner gets a full snapshot with its bully id, everyone else the update
+        void joined(const Client& client, const std::vector<Client>& table);
+        void left(const Client& client);
+        // Same member with new details, everyone gets it including the member itself
+        void updated(const Client& client);
+        void set_upstream(const std::vector<Client>& upstream);
+        // Anything else every subscriber should hear, not part of the event history
+        void push(const Message& msg, const std::string& skip_ip);
+        // The table was replaced wholesale, everyone starts over from a snapshot
+        void resync(const std::vector<Client>& table);
+
+    private:
+        struct entry
+        {
+            std::uint64_t seq;
+            MemberUpdate update;
+        };
+
+        // These expect mutex to be held
+        void publish(const MemberUpdate& update, const std::string& skip_ip);
+        void broadcast(const frame_ptr& frame, const std::string& skip_ip);
+        void send_snapshot(const channel_ptr& channel, const std::string& ip, const std::vector<Client>& table) const;
+        std::vector<frame_ptr> upstream_frames() const;
+        Message events() const;
+        channel_ptr channel_for(const std::string& ip);
+
+        subscription_options options;
+        std::mutex mutex;
+        std::uint32_t epoch;
+        std::uint64_t seq = 0;
+        std::deque<entry> history;
+        std::unordered_map<std::string, channel_ptr> channels;
+        std::vector<Client> upstream;
+    };
+}
@@ -0,0 +1,80 @@
+#include "queue_crdt.hpp"
+
+#include <cstdio>
+#include <deque>
+
+using hnoker::queue_crdt;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    if (!ok)
+    {
+        std::printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static void merge_snapshot(queue_crdt& into, const queue_crdt& from)
+{
+    for (const auto& piece : from.snapshot(20))
+        into.merge(piece, from.horizon());
+}
+
+// A replica that joins after the others pruned the starting songs must not bring them back
+static void late_joiner_after_prune()
+{
+    const std::deque<int> initial{1, 2, 1, 2, 2};
+    queue_crdt early{1, initial};
+
+    // Enough pops that the tombstones of the starting songs get let go of
+    while (early.pop_front()) {}
+    for (int i = 0; i < 600; i++)
+    {
+        early.enqueue(100 + i);
+        early.pop_front();
+    }
+    early.enqueue(7);
+    early.enqueue(8);
+    check(early.horizon() > queue_crdt::item_id{5, 0}, "the starting songs were pruned");
+
+    queue_crdt late{2, initial};
+    merge_snapshot(late, early);
+    check(late.songs() == early.songs(), "late joiner ends up with the same queue");
+    check(late.songs() == std::deque<int>{7, 8}, "only the songs still queued are left");
+
+    // Going the other way changes nothing, and neither does hearing it all again
+    const auto before = early.songs();
+    merge_snapshot(early, late);
+    merge_snapshot(late, early);
+    check(early.songs() == before && late.songs() == before, "merging back and again is a no-op");
+
+    // A delta that still carries one of the starting songs doesn't bring it back either
+    late.merge({QueueItem{1, 0, 1, false}});
+    check(late.songs() == before, "items at or before the horizon stay out");
+}
+
+// The tombstones kept stay bounded however long the queue is used
+static void tombstones_stay_bounded()
+{
+    queue_crdt q{1};
+    for (int i = 0; i < 5000; i++)
+    {
+        q.enqueue(i);
+        q.pop_front();
+    }
+    std::size_t kept = 0;
+    for (const auto& piece : q.snapshot(20))
+        kept += piece.size();
+    check(kept <= 257, "tombstones are pruned from the front");
+}
+
+int main()
+{
+    late_joiner_after_prune();
+    tombstones_stay_bounded();
+    if (failures == 0)
+        std::printf("queue_crdt: all passed\n");
+    return failures == 0 ? 0 : 1;
+}